@@ -0,0 +1,60 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * LD_PRELOAD allocation counter for the shell, used by mallocs.sh.
+ * Counts malloc, calloc and realloc calls and writes the total to
+ * stderr when the process exits. LD_PRELOAD is dropped from the
+ * environment at load time so the commands the shell runs are not
+ * counted.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static long nallocs;
+
+void *
+malloc(size_t size)
+{
+	nallocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	nallocs++;
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	nallocs++;
+	return __libc_realloc(ptr, size);
+}
+
+__attribute__((constructor))
+static void
+startcount(void)
+{
+	unsetenv("LD_PRELOAD");
+	nallocs = 0;
+}
+
+__attribute__((destructor))
+static void
+reportcount(void)
+{
+	char buf[64];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "mallocs=%ld\n", nallocs);
+	if (write(STDERR_FILENO, buf, len) == -1) {
+		_exit(EXIT_FAILURE);
+	}
+}
@@ -0,0 +1,79 @@
+#!/bin/sh
+
+# Count the shell's allocations per script line with malloccount.c.
+# Each line shape runs as a script of N and of 2N copies; the
+# difference over N is what one more line costs once the arena, the
+# parse cache and the env are warm. Shapes under "steady" must cost
+# no allocation at all, the others are only reported.
+
+N=1000
+
+steady='true
+ifnot echo x y z
+echo a b | cat
+echo $HOME
+ls /dev/null > /dev/null
+cd .
+jobs'
+
+# An assignment keeps a copy of its value and glob(3) allocates
+# internally, so these are not expected to be zero.
+reported='X=abc
+echo /etc/host*'
+
+usage(){
+	echo "usage: mallocs.sh [shell.c]" 1>&2
+	exit 1
+}
+
+case $# in
+0)
+	SRC=shell.c
+	;;
+1)
+	SRC=$1
+	;;
+*)
+	usage
+esac
+
+DIR=`mktemp -d` || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+gcc -O2 -o "$DIR/shell" "$SRC" || exit 1
+gcc -O2 -shared -fPIC -o "$DIR/malloccount.so" malloccount.c || exit 1
+
+# mallocs <line> <copies>
+mallocs(){
+	i=0
+	while [ $i -lt $2 ]; do
+		echo "$1"
+		i=$((i + 1))
+	done > "$DIR/script"
+	LD_PRELOAD="$DIR/malloccount.so" "$DIR/shell" "$DIR/script" \
+	    2>&1 >/dev/null </dev/null | sed -n 's/^mallocs=//p'
+}
+
+# perline <line>
+perline(){
+	a=`mallocs "$1" $N`
+	b=`mallocs "$1" $((2 * N))`
+	echo $(((b - a) / N))
+}
+
+status=0
+echo "$steady" | while IFS= read -r line; do
+	n=`perline "$line"`
+	printf '%4s\t%s\n' "$n" "$line"
+	if [ "$n" != 0 ]; then
+		exit 1
+	fi
+done || status=1
+echo "$reported" | while IFS= read -r line; do
+	printf '%4s\t%s\t(reported only)\n' "`perline "$line"`" "$line"
+done
+
+if [ $status != 0 ]; then
+	echo "error: a steady-state line allocates" 1>&2
+fi
+exit $status
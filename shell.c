@@ -1,25 +1,568 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <pthread.h>
 #include <glob.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 enum {
 	MAX_LINE = 1024,
-	PATH_MAX = 4096
+	PATH_MAX = 4096,
+	INPUT_CHUNK = 64 * 1024,
+	MIN_TOKENS = 16,
+	ARENA_SIZE = 16 * 1024,
+	CACHE_ENTRIES = 256,
+	CACHE_BUCKETS = 512,
+	CACHE_MAXLINE = 4096,
+	PATH_BUCKETS = 64,
+	VAR_BUCKETS = 64,
+	RESULT_LEN = 4,
+	RESULT_ENTRY = sizeof("result=") - 1 + RESULT_LEN,
+	JOB_SLOTS = 64,
+	MAX_DONEJOBS = 1024,
+	INDEX_THREADS = 8,
+	INDEX_PARALLEL = 4,
+	SHM_VERSION = 1,
+	NSTDFDS = 3,
+	DIRENT_DIR = 4,
+	DIRENT_NAME = 256,
+	DIRCACHE_BUCKETS = 64,
+	DIRCACHE_ENTRIES = 64,
+	DIRCACHE_BYTES = 16 * 1024 * 1024,
+	DIRCACHE_SETTLE = 2,
+	WATCH_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+	    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF,
+	IMAGE_VERSION = 5
 };
 
+enum {
+	TOK_QUOTE = 1 << 0,
+	TOK_DOLLAR = 1 << 1,
+	TOK_REDIR = 1 << 2,
+	TOK_AMP = 1 << 3,
+	TOK_EQUAL = 1 << 4,
+	TOK_GLOB = 1 << 5,
+	TOK_TARGET = 1 << 6,
+	TOK_PIPE = 1 << 7
+};
+
+enum {
+	T_WORD,
+	T_QUOTED,
+	T_VAR,
+	T_GLOB,
+	T_ASSIGN,
+	T_BUILTIN,
+	T_REDIRIN,
+	T_REDIROUT,
+	T_BACKGROUND,
+	T_HEREDOC,
+	T_PIPE
+};
+
+enum {
+	B_NONE,
+	B_IFOK,
+	B_IFNOT,
+	B_CD,
+	B_EXIT,
+	B_ASSIGN,
+	B_PARSECACHE,
+	B_HASH,
+	B_JOBS,
+	B_WAIT,
+	B_KILL
+};
+
+struct ArenaChunk {
+	struct ArenaChunk *next;
+	max_align_t data[];
+};
+typedef struct ArenaChunk ArenaChunk;
+
+struct Arena {
+	char *base;
+	size_t size;
+	size_t used;
+	size_t overflow;
+	ArenaChunk *chunks;
+	char *last;
+};
+typedef struct Arena Arena;
+
+struct Buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
+typedef struct Buffer Buffer;
+
+/*
+ * One launch sent to the zygote: a header followed by size bytes of
+ * path, argv and envp strings. The cwd and every descriptor flagged
+ * in fdmask travel alongside as SCM_RIGHTS, in that order.
+ */
+struct ZygoteRequest {
+	uint32_t size;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t fdmask;
+};
+typedef struct ZygoteRequest ZygoteRequest;
+
+struct ZygoteReply {
+	int32_t kind;
+	int32_t pid;
+	int32_t status;
+	struct rusage usage;
+};
+typedef struct ZygoteReply ZygoteReply;
+
+struct ZygoteExit {
+	pid_t pid;
+	int status;
+	struct rusage usage;
+};
+typedef struct ZygoteExit ZygoteExit;
+
+struct Zygote {
+	int sock;
+	pid_t pid;
+	Buffer request;
+	ZygoteExit *exits;
+	int nexits;
+	int size;
+};
+typedef struct Zygote Zygote;
+
+/*
+ * A background pipeline. Reaped stages keep their pid negated, so a
+ * pid the kernel may already have reused is never signalled.
+ */
+struct Job {
+	int number;
+	int nprocs;
+	int alive;
+	int code;
+	pid_t *pids;
+	int *statuses;
+	char *line;
+	struct timespec start;
+	struct timespec end;
+	struct rusage usage;
+	struct Job *prev;
+	struct Job *next;
+};
+typedef struct Job Job;
+
+struct JobSlot {
+	pid_t pid;
+	Job *job;
+};
+typedef struct JobSlot JobSlot;
+
+/*
+ * Jobs are found by pid through an open-addressing table (pid 0 is an
+ * empty slot, -1 a tombstone) and by number through a dense array.
+ * used counts live and tombstoned slots, live only the pids.
+ * Finished jobs wait in a list in completion order until collected.
+ */
+struct JobTable {
+	JobSlot *slots;
+	size_t nslots;
+	size_t used;
+	size_t live;
+	Job **bynumber;
+	int maxnumber;
+	int capacity;
+	int *freenums;
+	int nfree;
+	int running;
+	Job *donehead;
+	Job *donetail;
+	int ndone;
+	Job *pinned;
+	int pipefail;
+};
+typedef struct JobTable JobTable;
+
+/*
+ * The shell's single wait point: SIGCHLD through a signalfd, the
+ * zygote's socket, the input descriptor and the PATH inotify fd all
+ * wake the same epoll. fg holds the pids of the foreground pipeline
+ * still being waited.
+ */
+struct Events {
+	int epfd;
+	int sigfd;
+	int input;
+	int pathfd;
+	int pathready;
+	Zygote *zygote;
+	JobTable *jobs;
+	pid_t *fg;
+	int *fgstatus;
+	int nfg;
+	int pending;
+};
+typedef struct Events Events;
+
+struct Input {
+	int fd;
+	int isterminal;
+	int iswhole;
+	int eof;
+	char *buf;
+	size_t size;
+	size_t start;
+	size_t end;
+	size_t mark;
+	size_t maxline;
+	char *retired;
+	Events *events;
+};
+typedef struct Input Input;
+
+struct Token {
+	char *text;
+	int kind;
+	int flags;
+};
+typedef struct Token Token;
+
+struct Command {
+	Token *tokens;
+	int ntokens;
+	int nwords;
+	int condition;
+	int builtin;
+	int background;
+	int heredoc;
+	int npipes;
+};
+typedef struct Command Command;
+
+/*
+ * assign holds the stage's leading NAME=value words; argv starts right
+ * after them in the same array.
+ */
+struct Stage {
+	char **argv;
+	char **assign;
+	int nassign;
+	struct Redirection *redir;
+	int heredoc;
+};
+typedef struct Stage Stage;
+
 struct LineToken {
 	char *line;
 	char **tokens;
+	Command *cmd;
+	Stage *stages;
+	int nstages;
+	glob_t globbuf;
+	Arena *arena;
 };
 typedef struct LineToken LineToken;
 
+struct CacheEntry {
+	struct CacheEntry *prev;
+	struct CacheEntry *next;
+	struct CacheEntry *chain;
+	uint64_t hash;
+	size_t len;
+	size_t size;
+	char *raw;
+	Command cmd;
+};
+typedef struct CacheEntry CacheEntry;
+
+struct CommandCache {
+	CacheEntry *buckets[CACHE_BUCKETS];
+	CacheEntry *head;
+	CacheEntry *tail;
+	int nentries;
+	size_t bytes;
+	long hits;
+	long misses;
+};
+typedef struct CommandCache CommandCache;
+
+/*
+ * A shell variable. An exported one owns the "name=value" entry at
+ * envp[slot] (-1 until it has one), refreshed through the dirty list.
+ */
+struct Var {
+	struct Var *next;
+	struct Var *nextdirty;
+	uint64_t hash;
+	char *value;
+	char *entry;
+	int slot;
+	int exported;
+	int dirty;
+	char name[];
+};
+typedef struct Var Var;
+
+struct VarTable {
+	Var **buckets;
+	int nbuckets;
+	int count;
+	Var *dirty;
+	Var **dirtytail;
+	Var *result;
+	int status;
+	int stale;
+	char **envp;
+	int nenv;
+	int envsize;
+	uint64_t generation;
+	uint64_t envgen;
+};
+typedef struct VarTable VarTable;
+
+struct PathEntry {
+	struct PathEntry *next;
+	uint64_t hash;
+	long hits;
+	unsigned long dirgen;
+	char *path;
+	char name[];
+};
+typedef struct PathEntry PathEntry;
+
+struct PathDir {
+	char *name;
+	int fd;
+	struct timespec mtime;
+};
+typedef struct PathDir PathDir;
+
+struct PathTable {
+	PathEntry **buckets;
+	int nbuckets;
+	int nentries;
+	int watchfd;
+	int watching;
+	PathDir *dirs;
+	int ndirs;
+	int relative;
+	int reload;
+	unsigned long dirgen;
+	time_t checked;
+	int index;
+	int indexed;
+	int nindexed;
+	double indextime;
+	int shared;
+	char *shm;
+	size_t shmsize;
+	unsigned long shmdirgen;
+	Events *events;
+};
+typedef struct PathTable PathTable;
+
+struct DirScan {
+	char *names;
+	size_t len;
+	size_t size;
+	struct timespec mtime;
+};
+typedef struct DirScan DirScan;
+
+struct IndexJob {
+	PathDir *dirs;
+	DirScan *scans;
+	int ndirs;
+	int next;
+};
+typedef struct IndexJob IndexJob;
+
+struct Dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+typedef struct Dirent64 Dirent64;
+
+struct DirName {
+	uint64_t ino;
+	uint32_t off;
+	unsigned char type;
+};
+typedef struct DirName DirName;
+
+/*
+ * The names of one directory as glob() last saw them, keyed by
+ * (dev, inode) and valid while its mtime and ctime are unchanged.
+ */
+struct DirListing {
+	struct DirListing *prev;
+	struct DirListing *next;
+	struct DirListing *chain;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	int reusable;
+	int cached;
+	int open;
+	int nnames;
+	size_t size;
+	DirName *names;
+	char *strings;
+};
+typedef struct DirListing DirListing;
+
+struct DirCache {
+	DirListing *buckets[DIRCACHE_BUCKETS];
+	DirListing *head;
+	DirListing *tail;
+	int nentries;
+	size_t bytes;
+};
+typedef struct DirCache DirCache;
+
+struct DirCursor {
+	DirListing *dir;
+	int next;
+	char ent[sizeof(Dirent64) + DIRENT_NAME]
+	    __attribute__((aligned(__alignof__(Dirent64))));
+};
+typedef struct DirCursor DirCursor;
+
+struct ShmHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t stale;
+	uint64_t size;
+	uint32_t path;
+	uint32_t ndirs;
+	uint32_t dirs;
+	uint32_t nbuckets;
+	uint32_t buckets;
+	uint32_t nentries;
+	uint32_t entries;
+	uint32_t pad;
+};
+typedef struct ShmHeader ShmHeader;
+
+struct ShmDir {
+	int64_t mtimesec;
+	int64_t mtimensec;
+	uint32_t name;
+	uint32_t pad;
+};
+typedef struct ShmDir ShmDir;
+
+struct ShmEntry {
+	uint64_t hash;
+	uint32_t next;
+	uint32_t name;
+	uint32_t path;
+	uint32_t pad;
+};
+typedef struct ShmEntry ShmEntry;
+
+struct ImageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nrecords;
+	uint64_t ntokens;
+	uint64_t stringsize;
+	uint64_t scriptsize;
+	int64_t mtimesec;
+	int64_t mtimensec;
+	uint64_t hash;
+};
+typedef struct ImageHeader ImageHeader;
+
+struct ImageRecord {
+	uint64_t tokens;
+	uint64_t heredoc;
+	uint64_t heredocsize;
+	int32_t ntokens;
+	int32_t nwords;
+	int32_t condition;
+	int32_t builtin;
+	int32_t background;
+	int32_t npipes;
+	int32_t hasheredoc;
+};
+typedef struct ImageRecord ImageRecord;
+
+struct ImageToken {
+	uint64_t text;
+	int32_t kind;
+	int32_t flags;
+};
+typedef struct ImageToken ImageToken;
+
+struct Image {
+	char *base;
+	size_t size;
+	ImageHeader *header;
+	ImageRecord *records;
+	ImageToken *tokens;
+	char *strings;
+	uint32_t next;
+};
+typedef struct Image Image;
+
+enum {
+	SPAWN_FORK,
+	SPAWN_VFORK,
+	SPAWN_POSIX,
+	SPAWN_ZYGOTE
+};
+
+enum {
+	ZYGOTE_STARTED,
+	ZYGOTE_EXITED
+};
+
+struct Options {
+	int compile;
+	int pathindex;
+	int shmindex;
+	int spawn;
+	int pipefail;
+	char *script;
+};
+typedef struct Options Options;
+
+struct ScanMap {
+	uint64_t *space;
+	uint64_t *meta;
+};
+typedef struct ScanMap ScanMap;
+
 struct Redirection {
 	int isinputredirect;
 	int isoutputredirect;
@@ -34,6 +577,27 @@ struct HereDoc {
 };
 typedef struct HereDoc HereDoc;
 
+struct Launch {
+	char *path;
+	char **argv;
+	char **envp;
+	int fds[NSTDFDS];
+};
+typedef struct Launch Launch;
+
+struct Spawner {
+	int engine;
+	int pipefail;
+	Zygote zygote;
+	Events *events;
+};
+typedef struct Spawner Spawner;
+
+extern char **environ;
+
+VarTable shellvars;
+DirCache dircache;
+
 void
 siginthandler(int sig)
 {
@@ -51,986 +615,5202 @@ itisterminal(void)
 
 }
 
-void
-initshell(void)
+int
+isregularfile(int fd, off_t *size)
 {
-	// char *homedir;
-	// homedir = getenv("HOME");
-
-	// if (homedir == NULL) {
-	//     fprintf(stderr, "Error: HOME environment variable not set. Using current directory.\n");
-	//     return;
-	// }
-	// if (chdir(homedir) != 0) {
-	//     fprintf(stderr, "Error: Failed to change directory to HOME (%s): %s\n", homedir, strerror(errno));
-	//     fprintf(stderr, "Using current directory as fallback.\n");
-	// }
+	struct stat statbuf;
 
-	if (setenv("result", "0", 1) != 0) {
-		perror("setenv");
+	if (fstat(fd, &statbuf) == -1) {
+		return 0;
 	}
+	*size = statbuf.st_size;
+	return S_ISREG(statbuf.st_mode);
 }
 
 void
-initlinetoken(LineToken *lt)
+initarena(Arena *arena)
 {
-	lt->line = NULL;
-	lt->tokens = NULL;
+	arena->size = ARENA_SIZE;
+	arena->used = 0;
+	arena->overflow = 0;
+	arena->chunks = NULL;
+	arena->last = NULL;
+	arena->base = malloc(arena->size);
+	if (arena->base == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
 }
 
-void
-changeresult(int result)
+size_t
+arenaalign(size_t size)
 {
-	if (result < 0 || result > 255) {
-		fprintf(stderr, "Error: result out of range (0-255)\n");
-		return;
-	}
-	char result_str[4];
+	size_t align = sizeof(max_align_t);
 
-	snprintf(result_str, sizeof(result_str), "%d", result);
-	setenv("result", result_str, 1);
+	return (size + align - 1) & ~(align - 1);
 }
 
-void
-checkbackgroundchilds()
+void *
+arenaoverflow(Arena *arena, size_t size)
 {
-	int status;
-	int pid;
+	ArenaChunk *chunk;
 
-	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-		printf("[%d]+ Done\n", pid);
-		changeresult(WEXITSTATUS(status));
+	chunk = malloc(sizeof(ArenaChunk) + size);
+	if (chunk == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
 	}
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->overflow += size;
+	return chunk->data;
 }
 
-char *
-getenvvar(char *var)
+void *
+arenaalloc(Arena *arena, size_t size)
 {
-	char *envvar;
-
-	envvar = getenv(var);
-	if (envvar == NULL) {
-		fprintf(stderr, "error: var %s does not exist\n", var);
+	size = arenaalign(size);
+	if (size > arena->size - arena->used) {
+		arena->last = arenaoverflow(arena, size);
+		return arena->last;
 	}
-	return envvar;
+	arena->last = arena->base + arena->used;
+	arena->used += size;
+	return arena->last;
 }
 
-void
-printpromt(void)
+/*
+ * Resize the latest allocation in place when it is at the top of the
+ * arena, otherwise move it. The old copy is reclaimed on the next reset.
+ */
+void *
+arenarealloc(Arena *arena, void *ptr, size_t oldsize, size_t size)
 {
-	char *user;
-	char *current_dir;
-
-	user = getenvvar("USER");
-
-	current_dir = getcwd(NULL, 0);
-
-	if (current_dir == NULL) {
-		perror("getcwd");
-		current_dir = getenvvar("HOME");
+	void *newptr;
+	size_t top;
+
+	if (ptr != NULL && ptr == arena->last &&
+	    (char *)ptr >= arena->base && (char *)ptr < arena->base + arena->size) {
+		top = (char *)ptr - arena->base;
+		if (arenaalign(size) <= arena->size - top) {
+			arena->used = top + arenaalign(size);
+			return ptr;
+		}
 	}
+	newptr = arenaalloc(arena, size);
+	if (ptr != NULL) {
+		memcpy(newptr, ptr, oldsize);
+	}
+	return newptr;
+}
 
-	printf("%s@:%s$ ", user, current_dir);
-	free(current_dir);
+char *
+arenastrdup(Arena *arena, char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return memcpy(arenaalloc(arena, len), str, len);
 }
 
+/*
+ * Release everything allocated since the last reset. If the line did
+ * not fit, the base block grows to the high-water mark so that lines of
+ * the same shape do not touch malloc again.
+ */
 void
-readline(char **pline, int isterminal)
+arenareset(Arena *arena)
 {
-	char line[MAX_LINE] = "";
+	ArenaChunk *chunk;
+	size_t needed;
 
-	if (isterminal) {
-		printpromt();
+	needed = arena->used + arena->overflow;
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		free(chunk);
 	}
 
-	if (fgets(line, MAX_LINE, stdin) != NULL) {
-		*pline = strdup(line);
-	} else {
-		if (isterminal) {
-			printf("\n");
+	if (arena->overflow > 0) {
+		while (arena->size < needed) {
+			arena->size *= 2;
+		}
+		free(arena->base);
+		arena->base = malloc(arena->size);
+		if (arena->base == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
 		}
-		*pline = NULL;
 	}
 
+	arena->used = 0;
+	arena->overflow = 0;
+	arena->last = NULL;
 }
 
 void
-freeline(char **line)
+freearena(Arena *arena)
 {
-	if (*line != NULL) {
-		free(*line);
-		*line = NULL;
-	}
+	arenareset(arena);
+	free(arena->base);
+	arena->base = NULL;
 }
 
 void
-freetokens(char ***tokens)
+initbuffer(Buffer *buf)
 {
-	if (*tokens != NULL) {
-		for (int i = 0; (*tokens)[i] != NULL; i++) {
-			free((*tokens)[i]);
-		}
-		free(*tokens);
-		*tokens = NULL;
-	}
+	buf->data = NULL;
+	buf->len = 0;
+	buf->size = 0;
 }
 
-void
-freelinetoken(LineToken *lt)
+size_t
+bufappend(Buffer *buf, void *data, size_t len)
 {
+	size_t off = buf->len;
 
-	if (lt == NULL) {
-		return;
+	while (buf->len + len > buf->size) {
+		buf->size = buf->size == 0 ? INPUT_CHUNK : 2 * buf->size;
+		buf->data = realloc(buf->data, buf->size);
+		if (buf->data == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
 	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return off;
+}
+
+LineToken *
+newlinetoken(Arena *arena)
+{
+	LineToken *lt = arenaalloc(arena, sizeof(LineToken));
 
-	freeline(&lt->line);
-	freetokens(&lt->tokens);
+	lt->line = NULL;
+	lt->tokens = NULL;
+	lt->stages = NULL;
+	lt->nstages = 0;
+	lt->cmd = NULL;
+	lt->arena = arena;
+	memset(&lt->globbuf, 0, sizeof(lt->globbuf));
+	return lt;
 }
 
-char **
-inittokens()
+uint64_t
+hashline(char *line, size_t len)
 {
-	char **tokens = malloc(MAX_LINE * sizeof(char *));
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
 
-	if (tokens == NULL) {
-		perror("malloc");
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)line[i];
+		hash *= 1099511628211ULL;
 	}
-	return tokens;
+	return hash;
 }
 
-int
-addtoken(char **tokens, int index, char *token)
+/*
+ * Look a variable up by the first len bytes of name, so that the name
+ * part of a NAME=value word can be used in place.
+ */
+Var *
+findvar(char *name, size_t len)
 {
-	tokens[index] = strdup(token);
-	if (tokens[index] == NULL) {
-		perror("strdup");
-		return -1;
+	uint64_t hash = hashline(name, len);
+	Var *var;
+
+	for (var = shellvars.buckets[hash % shellvars.nbuckets]; var != NULL;
+	     var = var->next) {
+		if (var->hash == hash && strncmp(var->name, name, len) == 0 &&
+		    var->name[len] == '\0') {
+			return var;
+		}
 	}
-	return 0;
+	return NULL;
 }
 
-char **
-tokenize(char *line)
+void
+growvars(void)
 {
-	char **tokens;
-	char *saveptr;
-	char *token;
-	int i = 0;
-
-	if (line == NULL) {
-		return NULL;
-	}
+	Var **buckets;
+	Var *var;
+	Var *next;
+	int nbuckets = 2 * shellvars.nbuckets;
+	int i;
 
-	tokens = inittokens();
-	if (tokens == NULL) {
-		return NULL;
+	buckets = calloc(nbuckets, sizeof(Var *));
+	if (buckets == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
 	}
-
-	token = strtok_r(line, " \t\n", &saveptr);
-
-	while (token != NULL) {
-		if (addtoken(tokens, i, token) == -1) {
-			freetokens(&tokens);
-			return NULL;
+	for (i = 0; i < shellvars.nbuckets; i++) {
+		for (var = shellvars.buckets[i]; var != NULL; var = next) {
+			next = var->next;
+			var->next = buckets[var->hash % nbuckets];
+			buckets[var->hash % nbuckets] = var;
 		}
-		i++;
-		token = strtok_r(NULL, " \t\n", &saveptr);
 	}
-
-	tokens[i] = NULL;
-	return tokens;
+	free(shellvars.buckets);
+	shellvars.buckets = buckets;
+	shellvars.nbuckets = nbuckets;
 }
 
-void
-removequote(char *token)
+/*
+ * Return the variable for name, creating it unset. The name is copied
+ * once here and every later lookup compares against this copy.
+ */
+Var *
+internvar(char *name, size_t len)
 {
-	int len = strlen(token);
+	uint64_t hash = hashline(name, len);
+	Var *var;
 
-	if (len > 0 && token[0] == '"') {
-		for (int j = 0; j < len; j++) {
-			token[j] = token[j + 1];
-		}
-		len--;
+	var = findvar(name, len);
+	if (var != NULL) {
+		return var;
 	}
-	if (len > 0 && token[len - 1] == '"') {
-		token[len - 1] = '\0';
+	if (shellvars.count >= shellvars.nbuckets) {
+		growvars();
 	}
+	var = malloc(sizeof(Var) + len + 1);
+	if (var == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(var->name, name, len);
+	var->name[len] = '\0';
+	var->hash = hash;
+	var->value = NULL;
+	var->entry = NULL;
+	var->slot = -1;
+	var->exported = 0;
+	var->dirty = 0;
+	var->nextdirty = NULL;
+	var->next = shellvars.buckets[hash % shellvars.nbuckets];
+	shellvars.buckets[hash % shellvars.nbuckets] = var;
+	shellvars.count++;
+	return var;
 }
 
+/*
+ * Note that an exported variable changed: the cached envp is out of
+ * date and the variable's entry is refreshed on the next buildenv().
+ * The list is kept in order so new variables are appended to envp in
+ * the order they were first set, as setenv() did.
+ */
 void
-removequotes(char **tokens)
+markdirty(Var *var)
 {
-	int i = 0;
-
-	while (tokens[i] != NULL) {
-		removequote(tokens[i]);
-		i++;
+	if (var->exported) {
+		shellvars.generation++;
+	}
+	if (var->exported && !var->dirty) {
+		var->dirty = 1;
+		var->nextdirty = NULL;
+		*shellvars.dirtytail = var;
+		shellvars.dirtytail = &var->nextdirty;
 	}
 }
 
-int
-replacetoken(char **token, char *newvalue)
+void
+setvalue(Var *var, char *value)
 {
-	char *newtoken = strdup(newvalue);
+	char *copy = strdup(value);
 
-	if (newtoken == NULL) {
+	if (copy == NULL) {
 		perror("strdup");
-		return 1;
+		exit(EXIT_FAILURE);
 	}
-	free(*token);
-	*token = newtoken;
-	return 0;
+	free(var->value);
+	var->value = copy;
 }
 
-int
-replaceenvvars(char **tokens)
+/*
+ * 'result' is held as an integer and only formatted when read.
+ */
+char *
+varvalue(Var *var)
 {
-	char *envvar;
-	int i = 0;
-
-	while (tokens[i] != NULL) {
-		if (tokens[i][0] == '$') {
-			envvar = getenvvar(tokens[i] + 1);
-			if (envvar == NULL) {
-				return 1;
-			}
-			if (replacetoken(&tokens[i], envvar)) {
-				return 1;
-			}
-		}
-		i++;
+	if (var == shellvars.result && shellvars.stale) {
+		snprintf(var->value, RESULT_LEN, "%d", shellvars.status);
+		shellvars.stale = 0;
 	}
-	return 0;
+	return var->value;
 }
 
-int
-nolinetoken(LineToken *lt)
+char *
+getvar(char *name)
 {
-	return lt->line == NULL || lt->tokens == NULL || lt->tokens[0] == NULL;
+	Var *var;
+
+	var = findvar(name, strlen(name));
+	if (var == NULL) {
+		return NULL;
+	}
+	return varvalue(var);
 }
 
 void
-globbing(char ***tokens)
+setvar(char *name, char *value)
 {
-	int flags;
-	int i;
-	int j;
-	char **new_tokens;
-	size_t count;
-	glob_t globbuf;
+	Var *var;
 
-	memset(&globbuf, 0, sizeof(globbuf));
-
-	flags = GLOB_NOCHECK;
-	for (i = 0; (*tokens)[i] != NULL; i++) {
-		if (i > 0)
-			flags |= GLOB_APPEND;
-		if (glob((*tokens)[i], flags, NULL, &globbuf) != 0) {
-			perror("glob");
-		}
+	var = internvar(name, strlen(name));
+	if (var == shellvars.result) {
+		shellvars.status = atoi(value);
+		shellvars.stale = 1;
+	} else {
+		setvalue(var, value);
 	}
+	var->exported = 1;
+	markdirty(var);
+}
 
-	freetokens(tokens);
-
-	count = globbuf.gl_pathc;
-	new_tokens = malloc((count + 1) * sizeof(char *));
-	if (new_tokens == NULL) {
-		perror("malloc");
-		globfree(&globbuf);
+void
+changeresult(int result)
+{
+	if (result < 0 || result > 255) {
+		fprintf(stderr, "Error: result out of range (0-255)\n");
 		return;
 	}
-
-	for (i = 0; i < count; i++) {
-		new_tokens[i] = strdup(globbuf.gl_pathv[i]);
-		if (new_tokens[i] == NULL) {
-			perror("strdup");
-			for (j = 0; j < i; j++) {
-				free(new_tokens[j]);
+	if (result == shellvars.status) {
+		return;
+	}
+	shellvars.status = result;
+	shellvars.stale = 1;
+	markdirty(shellvars.result);
+}
+
+void
+setslot(Var *var, char *entry)
+{
+	if (var->slot == -1) {
+		if (shellvars.nenv + 1 >= shellvars.envsize) {
+			shellvars.envsize = shellvars.envsize == 0 ?
+			    VAR_BUCKETS : 2 * shellvars.envsize;
+			shellvars.envp = realloc(shellvars.envp,
+						 shellvars.envsize *
+						 sizeof(char *));
+			if (shellvars.envp == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
 			}
-			free(new_tokens);
-			globfree(&globbuf);
-			return;
 		}
+		var->slot = shellvars.nenv++;
+		shellvars.envp[shellvars.nenv] = NULL;
+	}
+	free(var->entry);
+	var->entry = entry;
+	shellvars.envp[var->slot] = entry;
+}
+
+/*
+ * Take over the inherited environment, keeping its order in envp.
+ * environ is left alone: children get envp through execve().
+ */
+void
+initvars(void)
+{
+	char **env;
+	char *eq;
+	Var *var;
+
+	shellvars.nbuckets = VAR_BUCKETS;
+	shellvars.count = 0;
+	shellvars.dirty = NULL;
+	shellvars.dirtytail = &shellvars.dirty;
+	shellvars.envp = NULL;
+	shellvars.nenv = 0;
+	shellvars.envsize = 0;
+	shellvars.generation = 0;
+	shellvars.envgen = 0;
+	shellvars.buckets = calloc(shellvars.nbuckets, sizeof(Var *));
+	if (shellvars.buckets == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (env = environ; *env != NULL; env++) {
+		eq = strchr(*env, '=');
+		if (eq == NULL) {
+			continue;
+		}
+		var = internvar(*env, eq - *env);
+		setvalue(var, eq + 1);
+		var->exported = 1;
+		setslot(var, strdup(*env));
+		if (var->entry == NULL) {
+			perror("strdup");
+			exit(EXIT_FAILURE);
+		}
+	}
+	shellvars.result = internvar("result", strlen("result"));
+	free(shellvars.result->value);
+	shellvars.result->value = malloc(RESULT_LEN);
+	if (shellvars.result->value == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	shellvars.result->exported = 1;
+	setslot(shellvars.result, malloc(RESULT_ENTRY));
+	if (shellvars.result->entry == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
 	}
-	new_tokens[count] = NULL;
+	shellvars.status = 0;
+	shellvars.stale = 1;
+	markdirty(shellvars.result);
+}
 
-	globfree(&globbuf);
+/*
+ * The environment for the next exec. Nothing is done while the
+ * generation is unchanged; otherwise only the entries of the
+ * variables that changed are rebuilt, new ones appended. 'result'
+ * has a fixed-size entry that is rewritten in place.
+ */
+char **
+buildenv(void)
+{
+	char *value;
+	char *entry;
+	Var *var;
+	size_t len;
 
-	*tokens = new_tokens;
+	if (shellvars.envgen == shellvars.generation &&
+	    shellvars.envp != NULL) {
+		return shellvars.envp;
+	}
+	for (var = shellvars.dirty; var != NULL; var = var->nextdirty) {
+		var->dirty = 0;
+		value = varvalue(var);
+		if (var == shellvars.result) {
+			snprintf(var->entry, RESULT_ENTRY, "result=%s", value);
+			continue;
+		}
+		len = strlen(var->name) + strlen(value) + 2;
+		entry = malloc(len);
+		if (entry == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		snprintf(entry, len, "%s=%s", var->name, value);
+		setslot(var, entry);
+	}
+	shellvars.dirty = NULL;
+	shellvars.dirtytail = &shellvars.dirty;
+	shellvars.envgen = shellvars.generation;
+	return shellvars.envp;
 }
 
-int
-isifok(char **tokens)
+void
+freevars(void)
 {
-	return strcmp(tokens[0], "ifok") == 0;
+	Var *var;
+	Var *next;
+	int i;
+
+	for (i = 0; i < shellvars.nbuckets; i++) {
+		for (var = shellvars.buckets[i]; var != NULL; var = next) {
+			next = var->next;
+			free(var->value);
+			free(var->entry);
+			free(var);
+		}
+	}
+	free(shellvars.buckets);
+	free(shellvars.envp);
 }
 
-int
-isifnot(char **tokens)
+void
+initshell(void)
 {
-	return strcmp(tokens[0], "ifnot") == 0;
+	// char *homedir;
+	// homedir = getenv("HOME");
+
+	// if (homedir == NULL) {
+	//     fprintf(stderr, "Error: HOME environment variable not set. Using current directory.\n");
+	//     return;
+	// }
+	// if (chdir(homedir) != 0) {
+	//     fprintf(stderr, "Error: Failed to change directory to HOME (%s): %s\n", homedir, strerror(errno));
+	//     fprintf(stderr, "Using current directory as fallback.\n");
+	// }
+
+	initvars();
 }
 
 int
-exitwitherror(void)
+readfull(int fd, void *buf, size_t len)
 {
-	int correct;
+	char *p = buf;
+	ssize_t n;
 
-	correct = atoi(getenv("result"));
-	if (correct != 0) {
-		return 1;
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
 	}
 	return 0;
 }
 
 int
-exitwithsuccess(void)
+writefull(int fd, void *buf, size_t len)
 {
-	int correct;
+	char *p = buf;
+	ssize_t n;
 
-	correct = atoi(getenv("result"));
-	if (correct == 0) {
-		return 1;
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return -1;
+		}
+		p += n;
+		len -= n;
 	}
 	return 0;
 }
 
 void
-erasetoken(char **tokens, char *token)
+queueexit(Zygote *z, ZygoteReply *reply)
 {
-	int i;
-	int j;
-
-	i = 0;
-	while (tokens[i] != NULL) {
-		if (strcmp(tokens[i], token) == 0) {
-			free(tokens[i]);
-			for (j = i; tokens[j] != NULL; j++) {
-				tokens[j] = tokens[j + 1];
-			}
-			break;
+	if (z->nexits == z->size) {
+		z->size = z->size == 0 ? MIN_TOKENS : 2 * z->size;
+		z->exits = realloc(z->exits, z->size * sizeof(ZygoteExit));
+		if (z->exits == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
 		}
-		i++;
 	}
+	z->exits[z->nexits].pid = reply->pid;
+	z->exits[z->nexits].status = reply->status;
+	z->exits[z->nexits].usage = reply->usage;
+	z->nexits++;
 }
 
+/*
+ * Read the next reply from the zygote. Returns its kind, or -1 once
+ * the zygote is gone.
+ */
 int
-manageifokifnot(LineToken *lt)
+nextreply(Zygote *z, ZygoteReply *reply)
 {
-	if (isifok(lt->tokens)) {
-		if (exitwitherror()) {
-			return 1;
-		} else {
-			erasetoken(lt->tokens, "ifok");
-		}
-	} else if (isifnot(lt->tokens)) {
-		if (exitwithsuccess()) {
-			return 1;
-		} else {
-			erasetoken(lt->tokens, "ifnot");
-		}
+	if (readfull(z->sock, reply, sizeof(*reply)) == -1) {
+		fprintf(stderr, "zygote: connection lost\n");
+		errno = ECONNRESET;
+		return -1;
 	}
-	return 0;
+	return reply->kind;
 }
 
+/*
+ * The status of a pipeline: that of the last stage, or with pipefail
+ * that of the last stage that failed. A stage killed by a signal
+ * counts as 128 + the signal, one that never started (-1) as 1.
+ */
 int
-exitcommand(char **tokens)
+pipelinecode(int *statuses, int n, int pipefail)
 {
-	if (strcmp(tokens[0], "exit") == 0) {
-		return 1;
+	int result = 0;
+	int code;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		code = EXIT_FAILURE;
+		if (statuses[i] != -1 && WIFEXITED(statuses[i])) {
+			code = WEXITSTATUS(statuses[i]);
+		} else if (statuses[i] != -1 && WIFSIGNALED(statuses[i])) {
+			code = 128 + WTERMSIG(statuses[i]);
+		}
+		if (!pipefail || code != 0) {
+			result = code;
+		}
 	}
-	return 0;
+	return result;
 }
 
-int
-isenvassignment(char **tokens)
+void
+initjobtable(JobTable *jobs, int pipefail)
 {
-	return strchr(tokens[0], '=') != NULL;
+	jobs->nslots = JOB_SLOTS;
+	jobs->used = 0;
+	jobs->live = 0;
+	jobs->slots = calloc(jobs->nslots, sizeof(JobSlot));
+	jobs->bynumber = NULL;
+	jobs->maxnumber = 0;
+	jobs->capacity = 0;
+	jobs->freenums = NULL;
+	jobs->nfree = 0;
+	jobs->running = 0;
+	jobs->donehead = NULL;
+	jobs->donetail = NULL;
+	jobs->ndone = 0;
+	jobs->pinned = NULL;
+	jobs->pipefail = pipefail;
+	if (jobs->slots == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
 }
 
-void
-handleenvassignment(char **tokens)
+size_t
+jobslot(JobTable *jobs, pid_t pid)
 {
-	char *env_assignment = strdup(tokens[0]);
-	char *key = strtok(env_assignment, "=");
-	char *value = strtok(NULL, "=");
-
-	if (key && value) {
-		setenv(key, value, 1);
-		changeresult(0);
-	} else {
-		fprintf(stderr, "Invalid environment variable assignment: %s\n",
-			tokens[0]);
-		changeresult(1);
-	}
-	free(env_assignment);
+	return ((uint64_t)pid * 0x9e3779b97f4a7c15ULL >> 32) &
+	    (jobs->nslots - 1);
 }
 
-int
-builtincd(char **tokens)
+Job *
+findjob(JobTable *jobs, pid_t pid)
 {
-	return strcmp(tokens[0], "cd") == 0;
+	size_t i;
+
+	for (i = jobslot(jobs, pid); jobs->slots[i].pid != 0;
+	     i = (i + 1) & (jobs->nslots - 1)) {
+		if (jobs->slots[i].pid == pid) {
+			return jobs->slots[i].job;
+		}
+	}
+	return NULL;
 }
 
-int
-changedir(char *dir)
+/*
+ * Rehash into a table sized for the live pids, which also drops the
+ * tombstones left by removed jobs.
+ */
+void
+growjobtable(JobTable *jobs, size_t live)
 {
-	if (chdir(dir) != 0) {
-		perror("cd");
-		return 1;
+	JobSlot *old = jobs->slots;
+	size_t nold = jobs->nslots;
+	size_t i;
+	size_t j;
+
+	jobs->nslots = JOB_SLOTS;
+	while (jobs->nslots < 4 * live) {
+		jobs->nslots *= 2;
 	}
-	return 0;
+	jobs->slots = calloc(jobs->nslots, sizeof(JobSlot));
+	if (jobs->slots == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	jobs->used = 0;
+	for (i = 0; i < nold; i++) {
+		if (old[i].pid <= 0) {
+			continue;
+		}
+		for (j = jobslot(jobs, old[i].pid); jobs->slots[j].pid != 0;
+		     j = (j + 1) & (jobs->nslots - 1)) {
+			;
+		}
+		jobs->slots[j] = old[i];
+		jobs->used++;
+	}
+	free(old);
 }
 
+/*
+ * Map pid to job. A pid still held by a finished job was reused by
+ * the kernel, so the newer job takes the slot over. When the table
+ * fills up mostly with tombstones it is rehashed at the same size.
+ */
 void
-changecwd(char **tokens)
+insertjobpid(JobTable *jobs, pid_t pid, Job *job)
 {
-	char *homedir;
-	int result = 0;
+	size_t tomb = SIZE_MAX;
+	size_t i;
 
-	if (tokens[1] == NULL) {
-		homedir = getenvvar("HOME");
-		if (homedir == NULL) {
-			result = 1;
-		} else {
-			result = changedir(homedir);
+	if (4 * (jobs->used + 1) > 3 * jobs->nslots) {
+		growjobtable(jobs, jobs->live + 1);
+	}
+	for (i = jobslot(jobs, pid); jobs->slots[i].pid != 0;
+	     i = (i + 1) & (jobs->nslots - 1)) {
+		if (jobs->slots[i].pid == pid) {
+			jobs->slots[i].job = job;
+			return;
+		}
+		if (jobs->slots[i].pid == -1 && tomb == SIZE_MAX) {
+			tomb = i;
 		}
+	}
+	if (tomb != SIZE_MAX) {
+		i = tomb;
 	} else {
-		result = changedir(tokens[1]);
+		jobs->used++;
 	}
-
-	changeresult(result);
+	jobs->live++;
+	jobs->slots[i].pid = pid;
+	jobs->slots[i].job = job;
 }
 
 void
-waitchild(int pid)
+removejobpid(JobTable *jobs, pid_t pid, Job *job)
 {
-	int pidwait;
-	int status;
-	int exit_status;
+	size_t i;
+
+	for (i = jobslot(jobs, pid); jobs->slots[i].pid != 0;
+	     i = (i + 1) & (jobs->nslots - 1)) {
+		if (jobs->slots[i].pid == pid) {
+			if (jobs->slots[i].job == job) {
+				jobs->slots[i].pid = -1;
+				jobs->slots[i].job = NULL;
+				jobs->live--;
+			}
+			return;
+		}
+	}
+}
 
-	do {
-		pidwait = waitpid(pid, &status, 0);
-		if (pidwait == -1) {
-			perror("waitpid");
+int
+newjobnumber(JobTable *jobs)
+{
+	if (jobs->nfree > 0) {
+		return jobs->freenums[--jobs->nfree];
+	}
+	if (jobs->maxnumber + 1 >= jobs->capacity) {
+		jobs->capacity = jobs->capacity == 0 ? JOB_SLOTS :
+		    2 * jobs->capacity;
+		jobs->bynumber = realloc(jobs->bynumber,
+					 jobs->capacity * sizeof(Job *));
+		jobs->freenums = realloc(jobs->freenums,
+					 jobs->capacity * sizeof(int));
+		if (jobs->bynumber == NULL || jobs->freenums == NULL) {
+			perror("realloc");
 			exit(EXIT_FAILURE);
 		}
-		if (WIFEXITED(status)) {
-			exit_status = WEXITSTATUS(status);
-			changeresult(exit_status);
-		}
-	} while (pidwait != pid);
+	}
+	return ++jobs->maxnumber;
 }
 
-int
-procbackground(char **tokens)
+void
+unlinkdone(JobTable *jobs, Job *job)
+{
+	if (job->prev != NULL) {
+		job->prev->next = job->next;
+	} else {
+		jobs->donehead = job->next;
+	}
+	if (job->next != NULL) {
+		job->next->prev = job->prev;
+	} else {
+		jobs->donetail = job->prev;
+	}
+	jobs->ndone--;
+}
+
+void
+removejob(JobTable *jobs, Job *job)
 {
 	int i;
 
-	for (i = 0; tokens[i] != NULL; i++) {
-		if (strcmp(tokens[i], "&") == 0) {
-			return 1;
+	if (job->alive == 0) {
+		unlinkdone(jobs, job);
+	} else {
+		jobs->running--;
+	}
+	for (i = 0; i < job->nprocs; i++) {
+		if (job->pids[i] != 0) {
+			removejobpid(jobs, abs(job->pids[i]), job);
 		}
 	}
-
-	return 0;
+	jobs->bynumber[job->number] = NULL;
+	if (job->number == jobs->maxnumber) {
+		jobs->maxnumber--;
+	} else {
+		jobs->freenums[jobs->nfree++] = job->number;
+	}
+	free(job);
 }
 
+/*
+ * Finished jobs are kept for 'jobs' and 'wait' in completion order,
+ * up to MAX_DONEJOBS; past that the oldest are forgotten, except the
+ * one a 'wait' is blocked on.
+ */
 void
-initredirect(Redirection *redir)
+finishjob(JobTable *jobs, Job *job)
 {
-	redir->isinputredirect = 0;
-	redir->isoutputredirect = 0;
-	redir->inputfile = NULL;
-	redir->outputfile = NULL;
+	Job *victim;
+
+	clock_gettime(CLOCK_MONOTONIC, &job->end);
+	job->code = pipelinecode(job->statuses, job->nprocs, jobs->pipefail);
+	jobs->running--;
+	job->prev = jobs->donetail;
+	job->next = NULL;
+	if (jobs->donetail != NULL) {
+		jobs->donetail->next = job;
+	} else {
+		jobs->donehead = job;
+	}
+	jobs->donetail = job;
+	jobs->ndone++;
+	if (jobs->ndone > MAX_DONEJOBS) {
+		victim = jobs->donehead;
+		if (victim == jobs->pinned) {
+			victim = victim->next;
+		}
+		removejob(jobs, victim);
+	}
 }
 
-void
-initredirection(Redirection **redir)
+/*
+ * The pids, their statuses and the command line live in the same
+ * allocation as the job, which outlives the line's arena.
+ */
+Job *
+addjob(JobTable *jobs, pid_t *pids, int n, char *line)
 {
-	*redir = malloc(sizeof(Redirection));
-	if (*redir == NULL) {
+	size_t len = strlen(line) + 1;
+	Job *job;
+	int i;
+
+	job = malloc(sizeof(Job) + n * (sizeof(pid_t) + sizeof(int)) + len);
+	if (job == NULL) {
 		perror("malloc");
+		exit(EXIT_FAILURE);
 	}
-	initredirect(*redir);
+	job->pids = (pid_t *)(job + 1);
+	job->statuses = (int *)(job->pids + n);
+	job->line = (char *)(job->statuses + n);
+	memcpy(job->line, line, len);
+	job->nprocs = n;
+	job->alive = 0;
+	job->code = 0;
+	memset(&job->usage, 0, sizeof(job->usage));
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	job->end = job->start;
+	job->prev = NULL;
+	job->next = NULL;
+	job->number = newjobnumber(jobs);
+	jobs->bynumber[job->number] = job;
+
+	for (i = 0; i < n; i++) {
+		job->pids[i] = pids[i];
+		job->statuses[i] = -1;
+		if (pids[i] > 0) {
+			job->alive++;
+			insertjobpid(jobs, pids[i], job);
+		}
+	}
+	jobs->running++;
+	if (job->alive == 0) {
+		finishjob(jobs, job);
+	}
+	return job;
 }
 
 void
-initheredoc(HereDoc **heredoc)
+addusage(struct rusage *sum, struct rusage *usage)
 {
-	*heredoc = malloc(sizeof(HereDoc));
-	if (*heredoc == NULL) {
-		perror("malloc");
+	timeradd(&sum->ru_utime, &usage->ru_utime, &sum->ru_utime);
+	timeradd(&sum->ru_stime, &usage->ru_stime, &sum->ru_stime);
+	if (usage->ru_maxrss > sum->ru_maxrss) {
+		sum->ru_maxrss = usage->ru_maxrss;
 	}
 }
 
-int
-redirorheredocnull(Redirection *redir, HereDoc *heredoc)
+char *
+jobstate(Job *job, char *buf, size_t size)
 {
-	return redir == NULL || heredoc == NULL;
+	int status = job->statuses[job->nprocs - 1];
+
+	if (job->alive > 0) {
+		snprintf(buf, size, "Running");
+	} else if (job->code == 0) {
+		snprintf(buf, size, "Done");
+	} else if (status != -1 && WIFSIGNALED(status)) {
+		snprintf(buf, size, "Killed(%d)", WTERMSIG(status));
+	} else {
+		snprintf(buf, size, "Exit(%d)", job->code);
+	}
+	return buf;
 }
 
 void
-freeredirections(Redirection *redir)
+freejobtable(JobTable *jobs)
 {
-	if (redir->inputfile != NULL) {
-		free(redir->inputfile);
-		redir->inputfile = NULL;
-	}
-	if (redir->outputfile != NULL) {
-		free(redir->outputfile);
-		redir->outputfile = NULL;
+	int i;
+
+	for (i = 1; i <= jobs->maxnumber; i++) {
+		free(jobs->bynumber[i]);
 	}
+	free(jobs->bynumber);
+	free(jobs->freenums);
+	free(jobs->slots);
 }
 
-void
-freeall(LineToken *lt, Redirection *redir, HereDoc *heredoc)
+int
+addevent(Events *ev, int fd)
 {
-	freelinetoken(lt);
-	free(lt);
-	freeredirections(redir);
-	free(redir);
-	free(heredoc);
-	lt = NULL;
-	redir = NULL;
-	heredoc = NULL;
+	struct epoll_event event;
+
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	return epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &event);
 }
 
-void
-initredirandheredoc(Redirection **redir, HereDoc **heredoc, LineToken *lt)
+/*
+ * Arm fd for a single wakeup; EPOLLONESHOT disarms it again as soon as
+ * it is reported, so a descriptor nobody reads yet cannot keep waking
+ * the loop.
+ */
+int
+armevent(Events *ev, int fd, int op)
 {
-	initredirection(redir);
-	initheredoc(heredoc);
-	if (redirorheredocnull(*redir, *heredoc)) {
-		freeall(lt, *redir, *heredoc);
-		exit(EXIT_FAILURE);
-	}
+	struct epoll_event event;
+
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.fd = fd;
+	return epoll_ctl(ev->epfd, op, fd, &event);
 }
 
+/*
+ * SIGCHLD stays blocked in the shell and is only read from the
+ * signalfd, so children are reaped wherever the shell happens to wait.
+ */
 int
-isinputredirect(char *token)
+initevents(Events *ev, Zygote *zygote, JobTable *jobs)
 {
-	return strcmp(token, "<") == 0;
+	sigset_t mask;
+
+	ev->input = -1;
+	ev->pathfd = -1;
+	ev->pathready = 0;
+	ev->zygote = zygote;
+	ev->jobs = jobs;
+	ev->fg = NULL;
+	ev->fgstatus = NULL;
+	ev->nfg = 0;
+	ev->pending = 0;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	ev->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (ev->sigfd == -1) {
+		perror("signalfd");
+		return -1;
+	}
+	ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ev->epfd == -1 || addevent(ev, ev->sigfd) == -1 ||
+	    (zygote != NULL && addevent(ev, zygote->sock) == -1)) {
+		perror("epoll");
+		return -1;
+	}
+	return 0;
 }
 
+/*
+ * Regular files cannot be polled and never block, so only terminals
+ * and pipes are waited on through the loop. The input is added with no
+ * events: it is only armed by waitinput(), so unread input does not
+ * wake the shell while it waits for children.
+ */
 int
-isoutputredirect(char *token)
+watchinput(Events *ev, int fd)
 {
-	return strcmp(token, ">") == 0;
+	struct epoll_event event;
+
+	event.events = 0;
+	event.data.fd = fd;
+	if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		return -1;
+	}
+	ev->input = fd;
+	return 0;
 }
 
 void
-setredirection(int *redirectflag, char **file, char *token)
+freeevents(Events *ev)
 {
-	*redirectflag = 1;
-	*file = strdup(token);
-	if (*file == NULL) {
-		perror("strdup");
-		exit(EXIT_FAILURE);
+	close(ev->epfd);
+	close(ev->sigfd);
+}
+
+/*
+ * Hand an exit to the foreground wait or to its job. A job is
+ * announced as soon as its last stage is gone.
+ */
+void
+reportexit(Events *ev, pid_t pid, int status, struct rusage *usage)
+{
+	char state[32];
+	Job *job;
+	int i;
+
+	for (i = 0; i < ev->nfg; i++) {
+		if (ev->fg[i] == pid) {
+			ev->fg[i] = 0;
+			ev->fgstatus[i] = status;
+			ev->pending--;
+			return;
+		}
+	}
+	job = findjob(ev->jobs, pid);
+	if (job == NULL) {
+		return;
+	}
+	for (i = 0; i < job->nprocs; i++) {
+		if (job->pids[i] == pid) {
+			job->pids[i] = -pid;
+			job->statuses[i] = status;
+			job->alive--;
+		}
+	}
+	addusage(&job->usage, usage);
+	if (job->alive > 0) {
+		return;
 	}
+	finishjob(ev->jobs, job);
+	printf("[%d]+ %s\t%s\n", job->number,
+	       jobstate(job, state, sizeof(state)), job->line);
+	fflush(stdout);
+	changeresult(job->code);
 }
 
 void
-removeredirectiontokens(char **tokens, int i)
+reapchildren(Events *ev)
 {
-	int j;
+	struct signalfd_siginfo info;
+	struct rusage usage;
+	int status;
+	pid_t pid;
 
-	for (j = 0; j < 2; j++) {
-		erasetoken(tokens, tokens[i]);
+	while (read(ev->sigfd, &info, sizeof(info)) > 0) {
+		;
+	}
+	while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+		reportexit(ev, pid, status, &usage);
 	}
 }
 
+/*
+ * Exits the zygote sent while the shell was waiting for a start.
+ */
 void
-identifyredirections(char **tokens, Redirection *redir)
+flushzygote(Events *ev)
 {
+	Zygote *z = ev->zygote;
 	int i;
 
-	for (i = 0; tokens[i] != NULL; i++) {
-		if (isinputredirect(tokens[i])) {
-			setredirection(&redir->isinputredirect,
-				       &redir->inputfile, tokens[i + 1]);
-			removeredirectiontokens(tokens, i);
-			i--;
-		} else if (isoutputredirect(tokens[i])) {
-			setredirection(&redir->isoutputredirect,
-				       &redir->outputfile, tokens[i + 1]);
-			removeredirectiontokens(tokens, i);
-			i--;
-		}
+	if (z == NULL) {
+		return;
 	}
+	for (i = 0; i < z->nexits; i++) {
+		reportexit(ev, z->exits[i].pid, z->exits[i].status,
+			   &z->exits[i].usage);
+	}
+	z->nexits = 0;
 }
 
-int
-canacces(char *file)
+void
+readzygote(Events *ev)
 {
-	return access(file, R_OK) != 0;
+	ZygoteReply reply;
+
+	if (nextreply(ev->zygote, &reply) == -1) {
+		exit(EXIT_FAILURE);
+	}
+	if (reply.kind == ZYGOTE_EXITED) {
+		reportexit(ev, reply.pid, reply.status, &reply.usage);
+	}
 }
 
-void
-redirectinput(char *input_file)
+/*
+ * Wait up to timeout milliseconds and handle whatever is ready.
+ * Returns 1 when the input descriptor became readable.
+ */
+int
+dispatchevents(Events *ev, int timeout)
 {
-	int fd;
+	struct epoll_event events[NSTDFDS];
+	int ready = 0;
+	int n;
+	int i;
 
-	fd = open(input_file, O_RDONLY);
-	if (fd == -1) {
-		perror("open");
+	flushzygote(ev);
+	n = epoll_wait(ev->epfd, events, NSTDFDS, timeout);
+	if (n == -1 && errno != EINTR) {
+		perror("epoll_wait");
 		exit(EXIT_FAILURE);
 	}
-	dup2(fd, STDIN_FILENO);
-	close(fd);
+	for (i = 0; i < n; i++) {
+		if (events[i].data.fd == ev->sigfd) {
+			reapchildren(ev);
+		} else if (ev->zygote != NULL &&
+			   events[i].data.fd == ev->zygote->sock) {
+			readzygote(ev);
+		} else if (events[i].data.fd == ev->input) {
+			ready = 1;
+		} else if (events[i].data.fd == ev->pathfd) {
+			ev->pathready = 1;
+		}
+	}
+	return ready;
+}
+
+void
+waitinput(Events *ev)
+{
+	if (armevent(ev, ev->input, EPOLL_CTL_MOD) == -1) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	while (!dispatchevents(ev, -1)) {
+		;
+	}
+}
+
+char *
+getenvvar(char *var)
+{
+	char *envvar;
+
+	envvar = getvar(var);
+	if (envvar == NULL) {
+		fprintf(stderr, "error: var %s does not exist\n", var);
+	}
+	return envvar;
+}
+
+void
+printpromt(void)
+{
+	char *user;
+	char *current_dir;
+
+	user = getenvvar("USER");
+
+	current_dir = getcwd(NULL, 0);
+
+	if (current_dir == NULL) {
+		perror("getcwd");
+		current_dir = getenvvar("HOME");
+	}
+
+	printf("%s@:%s$ ", user, current_dir);
+	free(current_dir);
+}
+
+void
+initinput(Input *in, int fd, int isterminal)
+{
+	in->fd = fd;
+	in->isterminal = isterminal;
+	in->iswhole = 0;
+	in->eof = 0;
+	in->size = INPUT_CHUNK;
+	in->start = 0;
+	in->end = 0;
+	in->mark = 0;
+	in->maxline = sysconf(_SC_ARG_MAX);
+	in->retired = NULL;
+	in->events = NULL;
+	in->buf = malloc(in->size);
+	if (in->buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * A regular file is read whole with one read() into a buffer sized
+ * from st_size, with a spare byte so even a last line without a
+ * newline is terminated in place. A script rewritten while it runs
+ * keeps the contents it had when it started.
+ */
+int
+loadinput(Input *in, int fd)
+{
+	off_t size;
+	size_t len = 0;
+	ssize_t n;
+	char *buf;
+
+	if (!isregularfile(fd, &size) || size <= 0 || size != (size_t)size) {
+		return -1;
+	}
+
+	buf = malloc(size + 1);
+	if (buf == NULL) {
+		return -1;
+	}
+	while (len < size) {
+		n = read(fd, buf + len, size - len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			perror("read");
+			free(buf);
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		len += n;
+	}
+
+	in->fd = fd;
+	in->isterminal = 0;
+	in->iswhole = 1;
+	in->eof = 1;
+	in->buf = buf;
+	in->size = size + 1;
+	in->start = 0;
+	in->end = len;
+	in->mark = 0;
+	in->maxline = sysconf(_SC_ARG_MAX);
+	in->retired = NULL;
+	in->events = NULL;
+	return 0;
+}
+
+void
+openinput(Input *in, int fd, int isterminal)
+{
+	if (!isterminal && loadinput(in, fd) == 0) {
+		return;
+	}
+	initinput(in, fd, isterminal);
+}
+
+void
+freeinput(Input *in)
+{
+	free(in->retired);
+	free(in->buf);
+	in->retired = NULL;
+	in->buf = NULL;
+}
+
+/*
+ * Make room at the end of the buffer keeping everything from keep on.
+ * When the last line handed out is pinned its bytes must not move, so
+ * the data is copied to a new buffer and the old one is retired until
+ * the next readline().
+ */
+void
+growinput(Input *in, size_t keep, int pinned)
+{
+	size_t len = in->end - keep;
+	size_t size = in->size;
+	char *buf;
+
+	if (!pinned && len < size / 2) {
+		memmove(in->buf, in->buf + keep, len);
+	} else {
+		if (len >= size / 2) {
+			size *= 2;
+		}
+		buf = malloc(size);
+		if (buf == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(buf, in->buf + keep, len);
+		if (pinned && in->retired == NULL) {
+			in->retired = in->buf;
+		} else {
+			free(in->buf);
+		}
+		in->buf = buf;
+		in->size = size;
+	}
+	in->start -= keep;
+	in->mark = in->mark > keep ? in->mark - keep : 0;
+	in->end = len;
+}
+
+int
+fillinput(Input *in, int pinned)
+{
+	ssize_t n;
+
+	if (in->end + 1 >= in->size) {
+		growinput(in, pinned ? in->mark : in->start, pinned);
+	}
+
+	if (in->events != NULL) {
+		waitinput(in->events);
+	}
+	do {
+		n = read(in->fd, in->buf + in->end, in->size - in->end - 1);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1) {
+		perror("read");
+		in->eof = 1;
+		return -1;
+	}
+	if (n == 0) {
+		in->eof = 1;
+	}
+	in->end += n;
+	return n;
+}
+
+int
+nextline(Input *in, int pinned, size_t *off, size_t *len)
+{
+	size_t scanned = 0;
+	char *nl;
+
+	for (;;) {
+		nl = memchr(in->buf + in->start + scanned, '\n',
+			    in->end - in->start - scanned);
+		if (nl != NULL) {
+			*off = in->start;
+			*len = nl - (in->buf + in->start) + 1;
+			in->start += *len;
+			return 1;
+		}
+		scanned = in->end - in->start;
+		if (in->eof || fillinput(in, pinned) <= 0) {
+			break;
+		}
+	}
+
+	if (in->start == in->end) {
+		return 0;
+	}
+	*off = in->start;
+	*len = in->end - in->start;
+	in->start = in->end;
+	return 1;
+}
+
+void
+readline(Input *in, char **pline)
+{
+	size_t off;
+	size_t len;
+	char *line;
+
+	free(in->retired);
+	in->retired = NULL;
+
+	if (in->isterminal) {
+		printpromt();
+		fflush(stdout);
+	}
+
+	if (nextline(in, 0, &off, &len) == 0) {
+		if (in->isterminal) {
+			printf("\n");
+		}
+		*pline = NULL;
+		return;
+	}
+
+	in->mark = off;
+	line = in->buf + off;
+	if (line[len - 1] == '\n') {
+		len--;
+	}
+	if (len > in->maxline) {
+		fprintf(stderr, "Error: line too long (%zu bytes, max %zu)\n",
+			len, in->maxline);
+		changeresult(1);
+		len = 0;
+	}
+	line[len] = '\0';
+	*pline = line;
+}
+
+void
+freelinetoken(LineToken *lt)
+{
+	if (lt == NULL) {
+		return;
+	}
+
+	globfree(&lt->globbuf);
+	arenareset(lt->arena);
+}
+
+int
+isspacechar(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+int
+metaclass(char c)
+{
+	switch (c) {
+	case '"':
+	case '\'':
+		return TOK_QUOTE;
+	case '$':
+		return TOK_DOLLAR;
+	case '<':
+	case '>':
+		return TOK_REDIR;
+	case '&':
+		return TOK_AMP;
+	case '|':
+		return TOK_PIPE;
+	case '=':
+		return TOK_EQUAL;
+	case '*':
+	case '?':
+	case '[':
+		return TOK_GLOB;
+	}
+	return 0;
+}
+
+void
+scanscalar(char *line, size_t from, size_t len, ScanMap *map)
+{
+	uint64_t bit;
+	size_t i;
+
+	for (i = from; i < len; i++) {
+		bit = (uint64_t)1 << (i % 64);
+		if (isspacechar(line[i])) {
+			map->space[i / 64] |= bit;
+		} else if (metaclass(line[i])) {
+			map->meta[i / 64] |= bit;
+		}
+	}
+}
+
+#ifdef __SSE2__
+uint64_t
+spacemasksse2(__m128i v)
+{
+	__m128i m;
+
+	m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+			 _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+	return (uint16_t)_mm_movemask_epi8(m);
+}
+
+uint64_t
+metamasksse2(__m128i v)
+{
+	const char *metachars = "\"'$<>&|=*?[";
+	__m128i m = _mm_setzero_si128();
+
+	for (; *metachars != '\0'; metachars++) {
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v,
+						   _mm_set1_epi8(*metachars)));
+	}
+	return (uint16_t)_mm_movemask_epi8(m);
+}
+
+size_t
+scansse2(char *line, size_t len, ScanMap *map)
+{
+	uint64_t space;
+	uint64_t meta;
+	__m128i v;
+	size_t i;
+	int j;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		space = 0;
+		meta = 0;
+		for (j = 0; j < 4; j++) {
+			v = _mm_loadu_si128((__m128i *)(line + i + 16 * j));
+			space |= spacemasksse2(v) << (16 * j);
+			meta |= metamasksse2(v) << (16 * j);
+		}
+		map->space[i / 64] = space;
+		map->meta[i / 64] = meta;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+uint64_t
+spacemaskavx2(__m256i v)
+{
+	__m256i m;
+
+	m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+			    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+	return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+uint64_t
+metamaskavx2(__m256i v)
+{
+	const char *metachars = "\"'$<>&|=*?[";
+	__m256i m = _mm256_setzero_si256();
+
+	for (; *metachars != '\0'; metachars++) {
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v,
+				    _mm256_set1_epi8(*metachars)));
+	}
+	return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+size_t
+scanavx2(char *line, size_t len, ScanMap *map)
+{
+	__m256i lo;
+	__m256i hi;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		lo = _mm256_loadu_si256((__m256i *)(line + i));
+		hi = _mm256_loadu_si256((__m256i *)(line + i + 32));
+		map->space[i / 64] = spacemaskavx2(lo) |
+		    spacemaskavx2(hi) << 32;
+		map->meta[i / 64] = metamaskavx2(lo) | metamaskavx2(hi) << 32;
+	}
+	return i;
+}
+#endif
+
+size_t
+scanvector(char *line, size_t len, ScanMap *map)
+{
+#ifdef __SSE2__
+	if (__builtin_cpu_supports("avx2")) {
+		return scanavx2(line, len, map);
+	}
+	return scansse2(line, len, map);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Find every delimiter and shell metacharacter of the line in one pass,
+ * one bit per byte: full 64-byte blocks are vectorized, the tail is
+ * scanned byte by byte.
+ */
+void
+scanline(Arena *arena, char *line, size_t len, ScanMap *map)
+{
+	size_t words = len / 64 + 1;
+	size_t done;
+
+	map->space = arenaalloc(arena, words * sizeof(uint64_t));
+	map->meta = arenaalloc(arena, words * sizeof(uint64_t));
+	memset(map->space, 0, words * sizeof(uint64_t));
+	memset(map->meta, 0, words * sizeof(uint64_t));
+
+	done = scanvector(line, len, map);
+	scanscalar(line, done, len, map);
+}
+
+size_t
+nextbit(uint64_t *map, size_t from, size_t len, int set)
+{
+	uint64_t word;
+	size_t i;
+
+	if (from >= len) {
+		return len;
+	}
+	i = from / 64;
+	word = set ? map[i] : ~map[i];
+	word &= ~(uint64_t)0 << (from % 64);
+	while (word == 0) {
+		i++;
+		if (i * 64 >= len) {
+			return len;
+		}
+		word = set ? map[i] : ~map[i];
+	}
+	from = i * 64 + __builtin_ctzll(word);
+	return from < len ? from : len;
+}
+
+int
+tokenclass(char *line, ScanMap *map, size_t start, size_t end)
+{
+	int flags = 0;
+	size_t i = start;
+
+	while ((i = nextbit(map->meta, i, end, 1)) < end) {
+		flags |= metaclass(line[i]);
+		i++;
+	}
+	return flags;
+}
+
+int
+removequote(char *token)
+{
+	int len = strlen(token);
+	int changed = 0;
+
+	if (len > 0 && token[0] == '"') {
+		for (int j = 0; j < len; j++) {
+			token[j] = token[j + 1];
+		}
+		len--;
+		changed = 1;
+	}
+	if (len > 0 && token[len - 1] == '"') {
+		token[len - 1] = '\0';
+		changed = 1;
+	}
+	return changed;
+}
+
+int
+operatorkind(char *text, int flags)
+{
+	if ((flags & TOK_REDIR) && strcmp(text, "<") == 0) {
+		return T_REDIRIN;
+	}
+	if ((flags & TOK_REDIR) && strcmp(text, ">") == 0) {
+		return T_REDIROUT;
+	}
+	if ((flags & TOK_AMP) && strcmp(text, "&") == 0) {
+		return T_BACKGROUND;
+	}
+	if ((flags & TOK_PIPE) && strcmp(text, "|") == 0) {
+		return T_PIPE;
+	}
+	if (strcmp(text, "HERE{") == 0) {
+		return T_HEREDOC;
+	}
+	return -1;
+}
+
+int
+conditionkind(char *text)
+{
+	if (strcmp(text, "ifok") == 0) {
+		return B_IFOK;
+	}
+	if (strcmp(text, "ifnot") == 0) {
+		return B_IFNOT;
+	}
+	return B_NONE;
+}
+
+int
+builtinkind(char *text)
+{
+	if (strcmp(text, "cd") == 0) {
+		return B_CD;
+	}
+	if (strcmp(text, "exit") == 0) {
+		return B_EXIT;
+	}
+	if (strcmp(text, "parsecache") == 0) {
+		return B_PARSECACHE;
+	}
+	if (strcmp(text, "hash") == 0) {
+		return B_HASH;
+	}
+	if (strcmp(text, "jobs") == 0) {
+		return B_JOBS;
+	}
+	if (strcmp(text, "wait") == 0) {
+		return B_WAIT;
+	}
+	if (strcmp(text, "kill") == 0) {
+		return B_KILL;
+	}
+	return B_NONE;
+}
+
+int
+isredirection(Token *tok)
+{
+	return tok->kind == T_REDIRIN || tok->kind == T_REDIROUT;
+}
+
+int
+wordkind(Token *tok)
+{
+	int quoted = 0;
+
+	if (tok->flags & TOK_QUOTE) {
+		quoted = removequote(tok->text);
+	}
+	if (tok->text[0] == '$') {
+		return T_VAR;
+	}
+	if (quoted) {
+		return T_QUOTED;
+	}
+	if (tok->flags & TOK_GLOB) {
+		return T_GLOB;
+	}
+	return T_WORD;
+}
+
+/*
+ * Whether every word so far in the current stage is an assignment, so
+ * that one more NAME=value word still belongs to the prefix.
+ */
+int
+stageprefix(Command *cmd)
+{
+	Token *tok;
+	int i;
+
+	for (i = cmd->ntokens - 1; i >= 0; i--) {
+		tok = &cmd->tokens[i];
+		if (tok->kind == T_PIPE) {
+			break;
+		}
+		if (tok->kind >= T_REDIRIN || (tok->flags & TOK_TARGET) ||
+		    (i == 0 && cmd->condition != B_NONE)) {
+			continue;
+		}
+		if (tok->kind != T_ASSIGN) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Classify a token once, from its text, the token before it and, for a
+ * NAME=value word, the words already in its stage. Everything later
+ * stages need is recorded here, so no stage has to search or shift the
+ * token array again.
+ */
+void
+classifytoken(Command *cmd, Token *tok)
+{
+	Token *prev = NULL;
+	int kind;
+
+	if (cmd->ntokens > 0) {
+		prev = &cmd->tokens[cmd->ntokens - 1];
+	}
+
+	kind = operatorkind(tok->text, tok->flags);
+	if (kind != -1) {
+		tok->kind = kind;
+		if (kind == T_BACKGROUND) {
+			cmd->background = 1;
+		} else if (kind == T_HEREDOC) {
+			cmd->heredoc = 1;
+		} else if (kind == T_PIPE) {
+			// Builtins only run on their own, never as a stage.
+			cmd->npipes++;
+			cmd->builtin = B_NONE;
+		}
+		return;
+	}
+
+	if (prev == NULL && conditionkind(tok->text) != B_NONE) {
+		tok->kind = T_BUILTIN;
+		cmd->condition = conditionkind(tok->text);
+		return;
+	}
+
+	tok->kind = wordkind(tok);
+	if (prev != NULL && isredirection(prev)) {
+		tok->flags |= TOK_TARGET;
+		return;
+	}
+
+	if (tok->kind != T_VAR && (tok->flags & TOK_EQUAL) &&
+	    stageprefix(cmd)) {
+		tok->kind = T_ASSIGN;
+		if (cmd->nwords == 0 && cmd->npipes == 0) {
+			cmd->builtin = B_ASSIGN;
+		}
+	} else if ((cmd->nwords == 0 || cmd->builtin == B_ASSIGN) &&
+		   tok->kind != T_VAR) {
+		// Assignments in front of a builtin are ignored, as there
+		// is no child to give them to.
+		cmd->builtin = builtinkind(tok->text);
+		if (cmd->builtin != B_NONE) {
+			tok->kind = T_BUILTIN;
+		}
+	} else if (cmd->builtin == B_ASSIGN) {
+		cmd->builtin = B_NONE;
+	}
+	cmd->nwords++;
+}
+
+Command *
+newcommand(Arena *arena, int size)
+{
+	Command *cmd = arenaalloc(arena, sizeof(Command));
+
+	cmd->tokens = arenaalloc(arena, size * sizeof(Token));
+	cmd->ntokens = 0;
+	cmd->nwords = 0;
+	cmd->condition = B_NONE;
+	cmd->builtin = B_NONE;
+	cmd->background = 0;
+	cmd->heredoc = 0;
+	cmd->npipes = 0;
+	return cmd;
+}
+
+void
+addtoken(Arena *arena, Command *cmd, int *size, char *text, int flags)
+{
+	Token *tok;
+
+	if (cmd->ntokens == *size) {
+		cmd->tokens = arenarealloc(arena, cmd->tokens,
+					   *size * sizeof(Token),
+					   2 * *size * sizeof(Token));
+		*size *= 2;
+	}
+	tok = &cmd->tokens[cmd->ntokens];
+	tok->text = text;
+	tok->flags = flags;
+	classifytoken(cmd, tok);
+	cmd->ntokens++;
+}
+
+void
+lexline(LineToken *lt, size_t len)
+{
+	ScanMap map;
+	size_t start;
+	size_t end;
+	int size = MIN_TOKENS;
+
+	scanline(lt->arena, lt->line, len, &map);
+
+	lt->cmd = newcommand(lt->arena, size);
+
+	start = nextbit(map.space, 0, len, 0);
+	while (start < len) {
+		end = nextbit(map.space, start, len, 1);
+		lt->line[end] = '\0';
+		addtoken(lt->arena, lt->cmd, &size, lt->line + start,
+			 tokenclass(lt->line, &map, start, end));
+		start = nextbit(map.space, end + 1, len, 0);
+	}
+}
+
+void
+initcache(CommandCache *cache)
+{
+	memset(cache, 0, sizeof(CommandCache));
+}
+
+void
+unlinkentry(CommandCache *cache, CacheEntry *entry)
+{
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+}
+
+void
+pushentry(CommandCache *cache, CacheEntry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head != NULL) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+}
+
+void
+evictentry(CommandCache *cache)
+{
+	CacheEntry *entry = cache->tail;
+	CacheEntry **link;
+
+	link = &cache->buckets[entry->hash % CACHE_BUCKETS];
+	while (*link != entry) {
+		link = &(*link)->chain;
+	}
+	*link = entry->chain;
+	unlinkentry(cache, entry);
+	cache->nentries--;
+	cache->bytes -= entry->size;
+	free(entry);
+}
+
+CacheEntry *
+lookupcache(CommandCache *cache, char *line, size_t len, uint64_t hash)
+{
+	CacheEntry *entry;
+
+	entry = cache->buckets[hash % CACHE_BUCKETS];
+	for (; entry != NULL; entry = entry->chain) {
+		if (entry->hash == hash && entry->len == len &&
+		    memcmp(entry->raw, line, len) == 0) {
+			unlinkentry(cache, entry);
+			pushentry(cache, entry);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Keep a private copy of a freshly lexed line: the raw text to compare
+ * against, and the lexed text with the token pointers moved onto it.
+ */
+void
+insertcache(CommandCache *cache, char *raw, LineToken *lt, size_t len,
+	    uint64_t hash)
+{
+	CacheEntry *entry;
+	Token *tokens;
+	char *lexed;
+	size_t size;
+	int i;
+
+	size = sizeof(CacheEntry) + lt->cmd->ntokens * sizeof(Token) +
+	    2 * (len + 1);
+	entry = malloc(size);
+	if (entry == NULL) {
+		return;
+	}
+	if (cache->nentries == CACHE_ENTRIES) {
+		evictentry(cache);
+	}
+
+	tokens = (Token *)(entry + 1);
+	entry->raw = (char *)(tokens + lt->cmd->ntokens);
+	lexed = entry->raw + len + 1;
+	memcpy(entry->raw, raw, len + 1);
+	memcpy(lexed, lt->line, len + 1);
+	entry->hash = hash;
+	entry->len = len;
+	entry->size = size;
+	entry->cmd = *lt->cmd;
+	entry->cmd.tokens = tokens;
+	for (i = 0; i < lt->cmd->ntokens; i++) {
+		tokens[i] = lt->cmd->tokens[i];
+		tokens[i].text = lexed + (tokens[i].text - lt->line);
+	}
+
+	entry->chain = cache->buckets[hash % CACHE_BUCKETS];
+	cache->buckets[hash % CACHE_BUCKETS] = entry;
+	pushentry(cache, entry);
+	cache->nentries++;
+	cache->bytes += size;
+}
+
+void
+freecache(CommandCache *cache)
+{
+	while (cache->tail != NULL) {
+		evictentry(cache);
+	}
+}
+
+/*
+ * Lines already seen skip lexing altogether; the cached Command is only
+ * read from then on, expansion still runs against it every time.
+ */
+void
+parseline(CommandCache *cache, LineToken *lt)
+{
+	CacheEntry *entry;
+	uint64_t hash;
+	size_t len;
+	char *raw = NULL;
+
+	len = strlen(lt->line);
+	hash = hashline(lt->line, len);
+
+	entry = lookupcache(cache, lt->line, len, hash);
+	if (entry != NULL) {
+		cache->hits++;
+		lt->cmd = &entry->cmd;
+		return;
+	}
+
+	cache->misses++;
+	if (len <= CACHE_MAXLINE) {
+		raw = arenaalloc(lt->arena, len + 1);
+		memcpy(raw, lt->line, len + 1);
+	}
+	lexline(lt, len);
+	if (raw != NULL) {
+		insertcache(cache, raw, lt, len, hash);
+	}
+}
+
+void
+printcachestats(CommandCache *cache)
+{
+	printf("parse cache: %ld hits, %ld misses, %d/%d entries, %zu bytes\n",
+	       cache->hits, cache->misses, cache->nentries, CACHE_ENTRIES,
+	       cache->bytes);
+	changeresult(0);
+}
+
+int
+counttokens(char **tokens)
+{
+	int i = 0;
+
+	while (tokens[i] != NULL) {
+		i++;
+	}
+	return i;
+}
+
+int
+nolinetoken(LineToken *lt)
+{
+	return (lt->tokens == NULL || lt->tokens[0] == NULL) &&
+	    (lt->stages == NULL || lt->stages[0].nassign == 0);
+}
+
+size_t
+dirbucket(dev_t dev, ino_t ino)
+{
+	return ((uint64_t)dev * 1099511628211ULL ^ (uint64_t)ino) %
+	    DIRCACHE_BUCKETS;
+}
+
+DirListing *
+finddir(dev_t dev, ino_t ino)
+{
+	DirListing *dir;
+
+	for (dir = dircache.buckets[dirbucket(dev, ino)]; dir != NULL;
+	     dir = dir->chain) {
+		if (dir->dev == dev && dir->ino == ino) {
+			return dir;
+		}
+	}
+	return NULL;
+}
+
+void
+unlinkdir(DirListing *dir)
+{
+	if (dir->prev != NULL) {
+		dir->prev->next = dir->next;
+	} else {
+		dircache.head = dir->next;
+	}
+	if (dir->next != NULL) {
+		dir->next->prev = dir->prev;
+	} else {
+		dircache.tail = dir->prev;
+	}
+}
+
+void
+pushdir(DirListing *dir)
+{
+	dir->prev = NULL;
+	dir->next = dircache.head;
+	if (dircache.head != NULL) {
+		dircache.head->prev = dir;
+	}
+	dircache.head = dir;
+	if (dircache.tail == NULL) {
+		dircache.tail = dir;
+	}
+}
+
+void
+freelisting(DirListing *dir)
+{
+	free(dir->names);
+	free(dir->strings);
+	free(dir);
+}
+
+void
+evictdir(DirListing *dir)
+{
+	DirListing **link;
+
+	link = &dircache.buckets[dirbucket(dir->dev, dir->ino)];
+	while (*link != dir) {
+		link = &(*link)->chain;
+	}
+	*link = dir->chain;
+	unlinkdir(dir);
+	dircache.nentries--;
+	dircache.bytes -= dir->size;
+	freelisting(dir);
+}
+
+/*
+ * Drop least recently used listings until the cache fits its bounds.
+ * A listing an open cursor still reads from is never dropped.
+ */
+void
+trimdircache(void)
+{
+	DirListing *dir = dircache.tail;
+	DirListing *prev;
+
+	while (dir != NULL && (dircache.nentries > DIRCACHE_ENTRIES ||
+			       dircache.bytes > DIRCACHE_BYTES)) {
+		prev = dir->prev;
+		if (dir->open == 0) {
+			evictdir(dir);
+		}
+		dir = prev;
+	}
+}
+
+int
+sametime(struct timespec *a, struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/*
+ * Read a whole directory into dir with getdents64(), like the PATH
+ * index does. A change made in the same timestamp tick as the listing
+ * would not move mtime, so a directory touched in the last
+ * DIRCACHE_SETTLE seconds is listed but not trusted for reuse.
+ */
+int
+readlisting(int fd, DirListing *dir)
+{
+	char buf[32 * 1024]
+	    __attribute__((aligned(__alignof__(Dirent64))));
+	time_t now = time(NULL);
+	size_t nsize = 0;
+	size_t ssize = 0;
+	size_t slen = 0;
+	Dirent64 *d;
+	size_t len;
+	long off;
+	long n;
+
+	dir->names = NULL;
+	dir->strings = NULL;
+	dir->nnames = 0;
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += d->d_reclen) {
+			d = (Dirent64 *)(buf + off);
+			len = strlen(d->d_name) + 1;
+			if (dir->nnames == nsize) {
+				nsize = nsize == 0 ? MIN_TOKENS : 2 * nsize;
+				dir->names = realloc(dir->names,
+						     nsize * sizeof(DirName));
+			}
+			while (slen + len > ssize) {
+				ssize = ssize == 0 ? PATH_MAX : 2 * ssize;
+				dir->strings = realloc(dir->strings, ssize);
+			}
+			if (dir->names == NULL || dir->strings == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+			dir->names[dir->nnames].ino = d->d_ino;
+			dir->names[dir->nnames].type = d->d_type;
+			dir->names[dir->nnames].off = slen;
+			memcpy(dir->strings + slen, d->d_name, len);
+			slen += len;
+			dir->nnames++;
+		}
+	}
+	if (n == -1) {
+		return -1;
+	}
+	dir->size = sizeof(DirListing) + nsize * sizeof(DirName) + ssize;
+	dir->reusable = dir->mtime.tv_sec + DIRCACHE_SETTLE < now &&
+	    dir->ctime.tv_sec + DIRCACHE_SETTLE < now;
+	return 0;
+}
+
+/*
+ * List path afresh. The listing is keyed by the opened directory
+ * itself and replaces any older one for it; while a cursor still
+ * reads the old one, the new listing is kept out of the cache.
+ */
+DirListing *
+loaddir(const char *path)
+{
+	DirListing *dir;
+	DirListing *old;
+	struct stat st;
+	int err;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	dir = malloc(sizeof(DirListing));
+	if (dir == NULL || fstat(fd, &st) == -1) {
+		err = errno;
+		free(dir);
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	dir->dev = st.st_dev;
+	dir->ino = st.st_ino;
+	dir->mtime = st.st_mtim;
+	dir->ctime = st.st_ctim;
+	dir->open = 0;
+	dir->cached = 0;
+	if (readlisting(fd, dir) == -1) {
+		err = errno;
+		close(fd);
+		freelisting(dir);
+		errno = err;
+		return NULL;
+	}
+	close(fd);
+
+	old = finddir(dir->dev, dir->ino);
+	if (old != NULL && old->open > 0) {
+		return dir;
+	}
+	if (old != NULL) {
+		evictdir(old);
+	}
+	dir->cached = 1;
+	dir->chain = dircache.buckets[dirbucket(dir->dev, dir->ino)];
+	dircache.buckets[dirbucket(dir->dev, dir->ino)] = dir;
+	pushdir(dir);
+	dircache.nentries++;
+	dircache.bytes += dir->size;
+	return dir;
+}
+
+/*
+ * glob()'s directory functions. An unchanged directory that was
+ * listed before costs a single stat(): the same (dev, inode) with the
+ * same mtime and ctime is served from its cached listing.
+ */
+void *
+globopendir(const char *path)
+{
+	DirCursor *cursor;
+	DirListing *dir;
+	struct stat st;
+
+	if (stat(path, &st) == -1) {
+		return NULL;
+	}
+	dir = finddir(st.st_dev, st.st_ino);
+	if (dir != NULL && dir->reusable &&
+	    sametime(&dir->mtime, &st.st_mtim) &&
+	    sametime(&dir->ctime, &st.st_ctim)) {
+		unlinkdir(dir);
+		pushdir(dir);
+	} else {
+		dir = loaddir(path);
+		if (dir == NULL) {
+			return NULL;
+		}
+	}
+	cursor = malloc(sizeof(DirCursor));
+	if (cursor == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	cursor->dir = dir;
+	cursor->next = 0;
+	dir->open++;
+	trimdircache();
+	return cursor;
+}
+
+/*
+ * Dirent64 has the layout of glibc's struct dirent on Linux, which is
+ * all glob() reads: d_ino, d_type and d_name.
+ */
+struct dirent *
+globreaddir(void *stream)
+{
+	DirCursor *cursor = stream;
+	DirListing *dir = cursor->dir;
+	Dirent64 *ent = (Dirent64 *)cursor->ent;
+	DirName *name;
+
+	if (cursor->next >= dir->nnames) {
+		return NULL;
+	}
+	name = &dir->names[cursor->next++];
+	ent->d_ino = name->ino;
+	ent->d_off = 0;
+	ent->d_reclen = sizeof(cursor->ent);
+	ent->d_type = name->type;
+	snprintf(ent->d_name, DIRENT_NAME, "%s", dir->strings + name->off);
+	return (struct dirent *)ent;
+}
+
+void
+globclosedir(void *stream)
+{
+	DirCursor *cursor = stream;
+
+	cursor->dir->open--;
+	if (!cursor->dir->cached) {
+		freelisting(cursor->dir);
+	} else {
+		trimdircache();
+	}
+	free(cursor);
+}
+
+void
+freedircache(void)
+{
+	while (dircache.head != NULL) {
+		evictdir(dircache.head);
+	}
+}
+
+int
+hasglobchars(char *token)
+{
+	return strpbrk(token, "*?[") != NULL;
+}
+
+/*
+ * Expand the wildcard words of argv. Words without a wildcard are
+ * never handed to glob(), so a line without any keeps its array as it
+ * is. Matches are not copied: they stay in the line's glob buffer,
+ * which every stage appends to and freelinetoken() releases.
+ */
+void
+globbing(LineToken *lt, char ***tokens)
+{
+	glob_t *globbuf = &lt->globbuf;
+	int flags;
+	int i;
+	int ntokens;
+	int npatterns = 0;
+	char **new_tokens;
+	size_t *first;
+	size_t count;
+	size_t j;
+	size_t k;
+
+	ntokens = counttokens(*tokens);
+	for (i = 0; i < ntokens; i++) {
+		npatterns += hasglobchars((*tokens)[i]);
+	}
+	if (npatterns == 0) {
+		return;
+	}
+	first = arenaalloc(lt->arena, (ntokens + 1) * sizeof(size_t));
+
+	count = ntokens - npatterns;
+	for (i = 0; i < ntokens; i++) {
+		first[i] = globbuf->gl_pathc;
+		if (!hasglobchars((*tokens)[i])) {
+			continue;
+		}
+		flags = GLOB_NOCHECK | GLOB_ALTDIRFUNC;
+		globbuf->gl_opendir = globopendir;
+		globbuf->gl_readdir = globreaddir;
+		globbuf->gl_closedir = globclosedir;
+		globbuf->gl_stat = stat;
+		globbuf->gl_lstat = lstat;
+		if (globbuf->gl_pathc > 0) {
+			flags |= GLOB_APPEND;
+		}
+		if (glob((*tokens)[i], flags, NULL, globbuf) != 0) {
+			perror("glob");
+		}
+		count += globbuf->gl_pathc - first[i];
+	}
+	first[ntokens] = globbuf->gl_pathc;
+
+	new_tokens = arenaalloc(lt->arena, (count + 1) * sizeof(char *));
+
+	k = 0;
+	for (i = 0; i < ntokens; i++) {
+		// A token that expands to itself keeps pointing into the line.
+		if (!hasglobchars((*tokens)[i]) ||
+		    (first[i + 1] - first[i] == 1 &&
+		     strcmp(globbuf->gl_pathv[first[i]], (*tokens)[i]) == 0)) {
+			new_tokens[k++] = (*tokens)[i];
+			continue;
+		}
+		for (j = first[i]; j < first[i + 1]; j++) {
+			new_tokens[k++] = globbuf->gl_pathv[j];
+		}
+	}
+	new_tokens[k] = NULL;
+
+	*tokens = new_tokens;
+}
+
+int
+exitwitherror(void)
+{
+	int correct;
+
+	correct = shellvars.status;
+	if (correct != 0) {
+		return 1;
+	}
+	return 0;
+}
+
+int
+exitwithsuccess(void)
+{
+	int correct;
+
+	correct = shellvars.status;
+	if (correct == 0) {
+		return 1;
+	}
+	return 0;
+}
+
+int
+manageifokifnot(LineToken *lt)
+{
+	if (lt->cmd->condition == B_IFOK) {
+		return exitwitherror();
+	}
+	if (lt->cmd->condition == B_IFNOT) {
+		return exitwithsuccess();
+	}
+	return 0;
+}
+
+int
+exitcommand(Command *cmd)
+{
+	return cmd->builtin == B_EXIT;
+}
+
+int
+isenvassignment(Command *cmd)
+{
+	return cmd->builtin == B_ASSIGN;
+}
+
+int
+isparsecache(Command *cmd)
+{
+	return cmd->builtin == B_PARSECACHE;
+}
+
+int
+ishash(Command *cmd)
+{
+	return cmd->builtin == B_HASH;
+}
+
+int
+isjobs(Command *cmd)
+{
+	return cmd->builtin == B_JOBS;
+}
+
+int
+iswait(Command *cmd)
+{
+	return cmd->builtin == B_WAIT;
+}
+
+int
+iskill(Command *cmd)
+{
+	return cmd->builtin == B_KILL;
+}
+
+void
+initpathtable(PathTable *table)
+{
+	memset(table, 0, sizeof(PathTable));
+	table->watchfd = -1;
+	table->nbuckets = PATH_BUCKETS;
+	table->buckets = calloc(table->nbuckets, sizeof(PathEntry *));
+	if (table->buckets == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+clearpathtable(PathTable *table)
+{
+	PathEntry *entry;
+	PathEntry *next;
+	int i;
+
+	for (i = 0; i < table->nbuckets; i++) {
+		for (entry = table->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+		table->buckets[i] = NULL;
+	}
+	table->nentries = 0;
+	table->indexed = 0;
+}
+
+void
+droppath(PathTable *table, char *command)
+{
+	uint64_t hash = hashline(command, strlen(command));
+	PathEntry **link = &table->buckets[hash % table->nbuckets];
+	PathEntry *entry;
+
+	for (; (entry = *link) != NULL; link = &entry->next) {
+		if (entry->hash == hash && strcmp(entry->name, command) == 0) {
+			*link = entry->next;
+			free(entry);
+			table->nentries--;
+			return;
+		}
+	}
+}
+
+void
+adddir(PathTable *table, char *dir)
+{
+	PathDir *pd;
+	struct stat st;
+
+	table->dirs = realloc(table->dirs, (table->ndirs + 1) * sizeof(PathDir));
+	if (table->dirs == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	pd = &table->dirs[table->ndirs++];
+	pd->name = strdup(dir);
+	if (pd->name == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	memset(&pd->mtime, 0, sizeof(pd->mtime));
+	pd->fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (pd->fd != -1 && fstat(pd->fd, &st) == 0) {
+		pd->mtime = st.st_mtim;
+	}
+	if (table->watchfd != -1) {
+		inotify_add_watch(table->watchfd, dir, WATCH_EVENTS |
+				  IN_ONLYDIR);
+	}
+}
+
+/*
+ * Open and watch every absolute PATH directory, so that entries only
+ * have to be dropped when a binary in them is added, removed, renamed
+ * or changes mode. Without inotify the directory mtimes are compared
+ * instead, at most once a second, and only to expire misses; found
+ * commands are trusted until PATH changes or "hash -r" is run.
+ */
+void
+watchpath(PathTable *table)
+{
+	char *path;
+	char *dir;
+
+	table->watching = 1;
+	table->relative = 0;
+	table->reload = 0;
+	table->checked = time(NULL);
+	path = getvar("PATH");
+	if (path == NULL) {
+		return;
+	}
+	table->watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (table->watchfd != -1 && table->events != NULL &&
+	    armevent(table->events, table->watchfd, EPOLL_CTL_ADD) == 0) {
+		table->events->pathfd = table->watchfd;
+		table->events->pathready = 0;
+	}
+
+	path = strdup(path);
+	if (path == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	for (dir = strtok(path, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+		if (dir[0] == '/') {
+			adddir(table, dir);
+		} else {
+			table->relative = 1;
+		}
+	}
+	free(path);
+}
+
+void
+detachshm(PathTable *table)
+{
+	if (table->shm != NULL) {
+		munmap(table->shm, table->shmsize);
+		table->shm = NULL;
+	}
+}
+
+void
+unwatchpath(PathTable *table)
+{
+	int i;
+
+	if (table->watchfd != -1) {
+		close(table->watchfd);
+		table->watchfd = -1;
+	}
+	if (table->events != NULL) {
+		table->events->pathfd = -1;
+	}
+	for (i = 0; i < table->ndirs; i++) {
+		if (table->dirs[i].fd != -1) {
+			close(table->dirs[i].fd);
+		}
+		free(table->dirs[i].name);
+	}
+	free(table->dirs);
+	table->dirs = NULL;
+	table->ndirs = 0;
+	table->watching = 0;
+	detachshm(table);
+}
+
+void
+checkdirs(PathTable *table)
+{
+	struct stat st;
+	time_t now;
+	int i;
+
+	now = time(NULL);
+	if (now == table->checked) {
+		return;
+	}
+	table->checked = now;
+	for (i = 0; i < table->ndirs; i++) {
+		if (table->dirs[i].fd == -1) {
+			if (stat(table->dirs[i].name, &st) == 0) {
+				table->reload = 1;
+			}
+			continue;
+		}
+		if (fstat(table->dirs[i].fd, &st) == -1 || st.st_nlink == 0) {
+			table->reload = 1;
+			continue;
+		}
+		if (table->watchfd == -1 &&
+		    (st.st_mtim.tv_sec != table->dirs[i].mtime.tv_sec ||
+		     st.st_mtim.tv_nsec != table->dirs[i].mtime.tv_nsec)) {
+			table->dirs[i].mtime = st.st_mtim;
+			table->dirgen++;
+		}
+	}
+}
+
+void
+readwatches(PathTable *table)
+{
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	ssize_t n;
+	char *p;
+
+	if (table->reload) {
+		clearpathtable(table);
+		unwatchpath(table);
+	}
+	if (!table->watching) {
+		watchpath(table);
+		return;
+	}
+	if (table->watchfd == -1) {
+		return;
+	}
+	// With the fd in the event loop, a lookup reads it only after the
+	// loop saw it become readable.
+	if (table->events != NULL && table->events->pathfd != -1) {
+		if (!table->events->pathready) {
+			return;
+		}
+		table->events->pathready = 0;
+		armevent(table->events, table->watchfd, EPOLL_CTL_MOD);
+	}
+
+	while ((n = read(table->watchfd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)p;
+			table->dirgen++;
+			if (event->mask & IN_Q_OVERFLOW) {
+				clearpathtable(table);
+			} else if (event->mask & (IN_IGNORED |
+			    IN_DELETE_SELF | IN_MOVE_SELF)) {
+				table->reload = 1;
+			} else if (event->len > 0) {
+				droppath(table, event->name);
+			}
+		}
+	}
+}
+
+void
+printpathtable(PathTable *table)
+{
+	PathEntry *entry;
+	int found = 0;
+	int i;
+
+	if (table->indexed) {
+		printf("index: %d commands from %d directories in %.2f ms\n",
+		       table->nindexed, table->ndirs, table->indextime);
+	} else if (table->shm != NULL && table->indextime > 0) {
+		printf("shared index: %d commands from %d directories, "
+		       "built in %.2f ms\n", table->nindexed, table->ndirs,
+		       table->indextime);
+	} else if (table->shm != NULL) {
+		printf("shared index: %d commands from %d directories\n",
+		       table->nindexed, table->ndirs);
+	}
+	for (i = 0; i < table->nbuckets; i++) {
+		for (entry = table->buckets[i]; entry != NULL;
+		     entry = entry->next) {
+			if (entry->path == NULL || entry->hits == 0) {
+				continue;
+			}
+			if (found++ == 0) {
+				printf("hits\tcommand\n");
+			}
+			printf("%4ld\t%s\n", entry->hits, entry->path);
+		}
+	}
+	if (found == 0) {
+		printf("hash: hash table empty\n");
+	}
+}
+
+void
+hashcommand(PathTable *table, char **tokens)
+{
+	if (tokens[1] == NULL) {
+		printpathtable(table);
+		fflush(stdout);
+		changeresult(0);
+	} else if (strcmp(tokens[1], "-r") == 0 && tokens[2] == NULL) {
+		clearpathtable(table);
+		unwatchpath(table);
+		changeresult(0);
+	} else {
+		fprintf(stderr, "usage: hash [-r]\n");
+		changeresult(1);
+	}
+}
+
+/*
+ * A job operand is %number or the pid of any of its stages.
+ */
+Job *
+parsejob(JobTable *jobs, char *arg)
+{
+	char *end;
+	long n;
+
+	if (arg[0] == '%') {
+		n = strtol(arg + 1, &end, 10);
+		if (end == arg + 1 || *end != '\0' || n < 1 ||
+		    n > jobs->maxnumber) {
+			return NULL;
+		}
+		return jobs->bynumber[n];
+	}
+	n = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || n <= 0 || (pid_t)n != n) {
+		return NULL;
+	}
+	return findjob(jobs, n);
+}
+
+double
+elapsedsec(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+	    (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * List every job with its state, wall time and the CPU time and peak
+ * RSS of the stages reaped so far. Finished jobs are dropped once
+ * listed.
+ */
+void
+jobscommand(JobTable *jobs, char **tokens)
+{
+	struct timespec now;
+	char state[32];
+	Job *job;
+	int max = jobs->maxnumber;
+	int i;
+
+	if (tokens[1] != NULL) {
+		fprintf(stderr, "usage: jobs\n");
+		changeresult(1);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 1; i <= max; i++) {
+		job = jobs->bynumber[i];
+		if (job == NULL) {
+			continue;
+		}
+		printf("[%d] %d %-10s %8.2fs %6.2fu %6.2fs %8ldk  %s\n",
+		       job->number, abs(job->pids[job->nprocs - 1]),
+		       jobstate(job, state, sizeof(state)),
+		       elapsedsec(&job->start, job->alive > 0 ? &now :
+				  &job->end),
+		       job->usage.ru_utime.tv_sec +
+		       job->usage.ru_utime.tv_usec / 1e6,
+		       job->usage.ru_stime.tv_sec +
+		       job->usage.ru_stime.tv_usec / 1e6,
+		       job->usage.ru_maxrss, job->line);
+		if (job->alive == 0) {
+			removejob(jobs, job);
+		}
+	}
+	fflush(stdout);
+	changeresult(0);
+}
+
+int
+waitjob(Events *ev, Job *job)
+{
+	int code;
+
+	ev->jobs->pinned = job;
+	while (job->alive > 0) {
+		dispatchevents(ev, -1);
+	}
+	ev->jobs->pinned = NULL;
+	code = job->code;
+	removejob(ev->jobs, job);
+	return code;
+}
+
+/*
+ * wait: every job; wait -n: the next job to finish, or the oldest
+ * one already finished; wait %n|pid...: those jobs. The result is the
+ * status of the last job waited for, 127 when there was none.
+ */
+void
+waitcommand(Events *ev, char **tokens)
+{
+	JobTable *jobs = ev->jobs;
+	int result = 0;
+	Job *job;
+	int i;
+
+	if (tokens[1] == NULL) {
+		while (jobs->running > 0) {
+			dispatchevents(ev, -1);
+		}
+		while (jobs->donehead != NULL) {
+			removejob(jobs, jobs->donehead);
+		}
+	} else if (strcmp(tokens[1], "-n") == 0 && tokens[2] == NULL) {
+		if (jobs->running == 0 && jobs->ndone == 0) {
+			result = 127;
+		}
+		while (jobs->ndone == 0 && jobs->running > 0) {
+			dispatchevents(ev, -1);
+		}
+		if (jobs->donehead != NULL) {
+			result = waitjob(ev, jobs->donehead);
+		}
+	} else {
+		for (i = 1; tokens[i] != NULL; i++) {
+			job = parsejob(jobs, tokens[i]);
+			if (job == NULL) {
+				fprintf(stderr, "wait: %s: no such job\n",
+					tokens[i]);
+				result = 127;
+				continue;
+			}
+			result = waitjob(ev, job);
+		}
+	}
+	changeresult(result);
+}
+
+int
+parsesignal(char *arg)
+{
+	char *name = arg;
+	char *end;
+	const char *abbrev;
+	long n;
+	int sig;
+
+	n = strtol(arg, &end, 10);
+	if (end != arg && *end == '\0') {
+		return n >= 0 && n < NSIG ? n : -1;
+	}
+	if (strncmp(name, "SIG", 3) == 0) {
+		name += 3;
+	}
+	for (sig = 1; sig < NSIG; sig++) {
+		abbrev = sigabbrev_np(sig);
+		if (abbrev != NULL && strcmp(abbrev, name) == 0) {
+			return sig;
+		}
+	}
+	return -1;
+}
+
+/*
+ * kill [-signal] %n|pid...: a %n operand signals every stage of the
+ * job that has not been reaped yet; a pid is signalled as given, even
+ * when it is one stage of a pipeline.
+ */
+void
+killcommand(JobTable *jobs, char **tokens)
+{
+	int sig = SIGTERM;
+	int result = 0;
+	Job *job;
+	pid_t pid;
+	int i = 1;
+	int j;
+
+	if (tokens[i] != NULL && tokens[i][0] == '-') {
+		sig = parsesignal(tokens[i] + 1);
+		if (sig == -1) {
+			fprintf(stderr, "kill: %s: invalid signal\n",
+				tokens[i] + 1);
+			changeresult(1);
+			return;
+		}
+		i++;
+	}
+	if (tokens[i] == NULL) {
+		fprintf(stderr, "usage: kill [-signal] %%job|pid...\n");
+		changeresult(1);
+		return;
+	}
+	for (; tokens[i] != NULL; i++) {
+		job = tokens[i][0] == '%' ? parsejob(jobs, tokens[i]) : NULL;
+		if (job != NULL) {
+			for (j = 0; j < job->nprocs; j++) {
+				if (job->pids[j] > 0 &&
+				    kill(job->pids[j], sig) == -1) {
+					perror("kill");
+					result = 1;
+				}
+			}
+		} else if (tokens[i][0] == '%') {
+			fprintf(stderr, "kill: %s: no such job\n", tokens[i]);
+			result = 1;
+		} else {
+			pid = atoi(tokens[i]);
+			if (pid <= 0 || kill(pid, sig) == -1) {
+				fprintf(stderr, "kill: %s: %s\n", tokens[i],
+					pid <= 0 ? "invalid pid" :
+					strerror(errno));
+				result = 1;
+			}
+		}
+	}
+	changeresult(result);
+}
+
+void
+handleenvassignment(PathTable *table, Arena *arena, Stage *stage)
+{
+	char *env_assignment;
+	char *key;
+	char *value;
+	int result = 0;
+	int i;
+
+	for (i = 0; i < stage->nassign; i++) {
+		env_assignment = arenastrdup(arena, stage->assign[i]);
+		key = strtok(env_assignment, "=");
+		value = strtok(NULL, "=");
+		if (key == NULL || value == NULL) {
+			fprintf(stderr, "Invalid environment variable "
+				"assignment: %s\n", stage->assign[i]);
+			result = 1;
+			continue;
+		}
+		setvar(key, value);
+		if (strcmp(key, "PATH") == 0) {
+			clearpathtable(table);
+			unwatchpath(table);
+		}
+	}
+	changeresult(result);
+}
+
+int
+builtincd(Command *cmd)
+{
+	return cmd->builtin == B_CD;
+}
+
+int
+changedir(char *dir)
+{
+	if (chdir(dir) != 0) {
+		perror("cd");
+		return 1;
+	}
+	return 0;
+}
+
+void
+changecwd(char **tokens)
+{
+	char *homedir;
+	int result = 0;
+
+	if (tokens[1] == NULL) {
+		homedir = getenvvar("HOME");
+		if (homedir == NULL) {
+			result = 1;
+		} else {
+			result = changedir(homedir);
+		}
+	} else {
+		result = changedir(tokens[1]);
+	}
+
+	changeresult(result);
+}
+
+void
+initredirect(Redirection *redir)
+{
+	redir->isinputredirect = 0;
+	redir->isoutputredirect = 0;
+	redir->inputfile = NULL;
+	redir->outputfile = NULL;
+}
+
+void
+initredirection(Arena *arena, Redirection **redir)
+{
+	*redir = arenaalloc(arena, sizeof(Redirection));
+	initredirect(*redir);
+}
+
+void
+initheredoc(HereDoc *heredoc)
+{
+	heredoc->lines = NULL;
+	heredoc->size = 0;
+}
+
+void
+setredirection(int *redirectflag, char **file, char *token)
+{
+	*redirectflag = 1;
+	*file = token;
+}
+
+char *
+expandtoken(Arena *arena, Token *tok)
+{
+	char *envvar;
+
+	if (tok->kind != T_VAR) {
+		return tok->text;
+	}
+	envvar = getenvvar(tok->text + 1);
+	if (envvar == NULL) {
+		return NULL;
+	}
+	return arenastrdup(arena, envvar);
+}
+
+void
+settarget(Command *cmd, int i, Redirection *redir, char *text)
+{
+	if (cmd->tokens[i - 1].kind == T_REDIRIN) {
+		setredirection(&redir->isinputredirect, &redir->inputfile,
+			       text);
+	} else {
+		setredirection(&redir->isoutputredirect, &redir->outputfile,
+			       text);
+	}
+}
+
+int
+missingtarget(Command *cmd, int i)
+{
+	return i + 1 >= cmd->ntokens ||
+	    !(cmd->tokens[i + 1].flags & TOK_TARGET);
+}
+
+Stage *
+newstage(LineToken *lt, Redirection *redir)
+{
+	Stage *stage = &lt->stages[lt->nstages++];
+
+	stage->argv = arenaalloc(lt->arena,
+				 (lt->cmd->nwords + 1) * sizeof(char *));
+	stage->assign = stage->argv;
+	stage->nassign = 0;
+	stage->redir = redir;
+	stage->heredoc = 0;
+	return stage;
+}
+
+int
+endstage(LineToken *lt, Stage *stage, int argc)
+{
+	stage->argv[argc] = NULL;
+	stage->argv += stage->nassign;
+	if (argc == stage->nassign && lt->cmd->npipes > 0) {
+		fprintf(stderr, "Error: missing command for |\n");
+		return 1;
+	}
+	globbing(lt, &stage->argv);
+	return 0;
+}
+
+/*
+ * Build argv and the redirections of every stage of a classified line:
+ * operators are skipped by kind, only variables are looked up and only
+ * the argument words are handed to globbing(). lt->tokens is the argv
+ * of the first stage, which is the whole command without a pipe.
+ */
+int
+expandcommand(LineToken *lt, Redirection *redir)
+{
+	Command *cmd = lt->cmd;
+	Stage *stage;
+	Token *tok;
+	char *text;
+	int argc = 0;
+	int i;
+
+	lt->stages = arenaalloc(lt->arena, (cmd->npipes + 1) * sizeof(Stage));
+	lt->nstages = 0;
+	stage = newstage(lt, redir);
+
+	for (i = 0; i < cmd->ntokens; i++) {
+		tok = &cmd->tokens[i];
+		if (isredirection(tok) && missingtarget(cmd, i)) {
+			fprintf(stderr, "Error: missing file for %s\n",
+				tok->text);
+			return 1;
+		}
+		if (tok->kind == T_PIPE) {
+			if (endstage(lt, stage, argc)) {
+				return 1;
+			}
+			initredirection(lt->arena, &redir);
+			stage = newstage(lt, redir);
+			argc = 0;
+			continue;
+		}
+		if (tok->kind == T_HEREDOC) {
+			stage->heredoc = 1;
+		}
+		if (tok->kind >= T_REDIRIN ||
+		    (i == 0 && cmd->condition != B_NONE)) {
+			continue;
+		}
+		text = expandtoken(lt->arena, tok);
+		if (text == NULL) {
+			return 1;
+		}
+		if (tok->flags & TOK_TARGET) {
+			settarget(cmd, i, stage->redir, text);
+		} else {
+			stage->nassign += tok->kind == T_ASSIGN;
+			stage->argv[argc++] = text;
+		}
+	}
+	if (endstage(lt, stage, argc)) {
+		return 1;
+	}
+
+	lt->tokens = lt->stages[0].argv;
+	return 0;
+}
+
+int
+noredirects(Redirection *redir)
+{
+	return !redir->isinputredirect && !redir->isoutputredirect;
+}
+
+int
+herecommand(Stage *stage)
+{
+	return stage->heredoc && noredirects(stage->redir);
+}
+
+int
+isheredocend(char *line, size_t len)
+{
+	return len == 2 && line[0] == '}' && line[1] == '\n';
+}
+
+void
+readheredoc(Input *in, HereDoc *heredoc)
+{
+	size_t body;
+	size_t off;
+	size_t len;
+
+	body = in->start - in->mark;
+	heredoc->size = 0;
+
+	while (nextline(in, 1, &off, &len) > 0) {
+		if (isheredocend(in->buf + off, len)) {
+			break;
+		}
+		heredoc->size += len;
+	}
+
+	heredoc->lines = in->buf + in->mark + body;
+}
+
+int
+islocalcommand(char *command)
+{
+	return strncmp(command, "./", 2) == 0 || access(command, X_OK) == 0;
+}
+
+int
+dotandslash(char *token)
+{
+	return token[0] == '.' && token[1] == '/';
+}
+
+char *
+searchpathstring(char *path, char *command)
+{
+	char *path_copy;
+	char *full_path;
+	char *dir;
+
+	if (path == NULL) {
+		return NULL;
+	}
+
+	path_copy = strdup(path);
+	if (path_copy == NULL) {
+		perror("strdup");
+		return NULL;
+	}
+
+	full_path = malloc(MAX_LINE);
+	if (full_path == NULL) {
+		perror("malloc");
+		free(path_copy);
+		return NULL;
+	}
+
+	dir = strtok(path_copy, ":");
+	while (dir != NULL) {
+		snprintf(full_path, MAX_LINE, "%s/%s", dir, command);
+		if (access(full_path, X_OK) == 0) {
+			free(path_copy);
+			return full_path;
+		}
+		dir = strtok(NULL, ":");
+	}
+
+	free(path_copy);
+	free(full_path);
+	return NULL;
+}
+
+/*
+ * Probe each PATH directory through its O_PATH descriptor, so a miss
+ * costs one single-component lookup per directory and no string is
+ * built until the command is found. A PATH with relative entries is
+ * still searched by name, since those follow the working directory.
+ */
+char *
+findcommandinpath(PathTable *table, char *command)
+{
+	PathDir *dir;
+	char *path;
+	int i;
+
+	if (table->relative) {
+		return searchpathstring(getvar("PATH"), command);
+	}
+	for (i = 0; i < table->ndirs; i++) {
+		dir = &table->dirs[i];
+		if (dir->fd != -1 && faccessat(dir->fd, command, X_OK, 0) == 0) {
+			path = malloc(strlen(dir->name) + strlen(command) + 2);
+			if (path == NULL) {
+				perror("malloc");
+				return NULL;
+			}
+			sprintf(path, "%s/%s", dir->name, command);
+			return path;
+		}
+	}
+	return NULL;
+}
+
+PathEntry *
+lookuppath(PathTable *table, char *command, uint64_t hash)
+{
+	PathEntry *entry;
+
+	entry = table->buckets[hash % table->nbuckets];
+	for (; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->name, command) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+void
+growpathtable(PathTable *table)
+{
+	PathEntry **buckets;
+	PathEntry *entry;
+	PathEntry *next;
+	int nbuckets = 2 * table->nbuckets;
+	int i;
+
+	buckets = calloc(nbuckets, sizeof(PathEntry *));
+	if (buckets == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < table->nbuckets; i++) {
+		for (entry = table->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash % nbuckets];
+			buckets[entry->hash % nbuckets] = entry;
+		}
+	}
+	free(table->buckets);
+	table->buckets = buckets;
+	table->nbuckets = nbuckets;
+}
+
+PathEntry *
+insertpath(PathTable *table, char *command, uint64_t hash, char *path)
+{
+	size_t namelen = strlen(command) + 1;
+	PathEntry *entry;
+
+	if (table->nentries >= 2 * table->nbuckets) {
+		growpathtable(table);
+	}
+
+	entry = malloc(sizeof(PathEntry) + namelen +
+		       (path != NULL ? strlen(path) + 1 : 0));
+	if (entry == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	entry->hash = hash;
+	entry->hits = 0;
+	entry->dirgen = table->dirgen;
+	memcpy(entry->name, command, namelen);
+	entry->path = NULL;
+	if (path != NULL) {
+		entry->path = entry->name + namelen;
+		strcpy(entry->path, path);
+	}
+
+	entry->next = table->buckets[hash % table->nbuckets];
+	table->buckets[hash % table->nbuckets] = entry;
+	table->nentries++;
+	return entry;
+}
+
+void
+addscanname(DirScan *scan, char *name)
+{
+	size_t len = strlen(name) + 1;
+
+	while (scan->len + len > scan->size) {
+		scan->size = scan->size == 0 ? 4096 : 2 * scan->size;
+		scan->names = realloc(scan->names, scan->size);
+		if (scan->names == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(scan->names + scan->len, name, len);
+	scan->len += len;
+}
+
+/*
+ * List the executables of one PATH directory with raw getdents64, which
+ * returns the file type along with each name, so only entries that
+ * could be commands need an faccessat().
+ */
+void
+scandir64(PathDir *dir, DirScan *scan)
+{
+	char buf[32 * 1024]
+	    __attribute__((aligned(__alignof__(Dirent64))));
+	Dirent64 *d;
+	long n;
+	struct stat st;
+	long off;
+	int fd;
+
+	if (dir->fd == -1) {
+		return;
+	}
+	fd = openat(dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+	if (fstat(fd, &st) == 0) {
+		scan->mtime = st.st_mtim;
+	}
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += d->d_reclen) {
+			d = (Dirent64 *)(buf + off);
+			if (d->d_type == DIRENT_DIR || d->d_name[0] == '.') {
+				continue;
+			}
+			if (faccessat(fd, d->d_name, X_OK, 0) == 0) {
+				addscanname(scan, d->d_name);
+			}
+		}
+	}
+	close(fd);
+}
+
+void *
+indexworker(void *arg)
+{
+	IndexJob *job = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->ndirs) {
+		scandir64(&job->dirs[i], &job->scans[i]);
+	}
+	return NULL;
+}
+
+/*
+ * List every PATH directory, sharing them out to a few threads when
+ * PATH is long. The result has one DirScan per directory, in order.
+ */
+DirScan *
+scanpath(PathTable *table)
+{
+	pthread_t threads[INDEX_THREADS];
+	IndexJob job;
+	long maxthreads;
+	int nthreads = 0;
+	int i;
+
+	job.dirs = table->dirs;
+	job.ndirs = table->ndirs;
+	job.next = 0;
+	job.scans = calloc(table->ndirs + 1, sizeof(DirScan));
+	if (job.scans == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	maxthreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (maxthreads > INDEX_THREADS) {
+		maxthreads = INDEX_THREADS;
+	}
+	if (table->ndirs >= INDEX_PARALLEL) {
+		for (; nthreads < maxthreads && nthreads < table->ndirs;
+		     nthreads++) {
+			if (pthread_create(&threads[nthreads], NULL,
+					   indexworker, &job) != 0) {
+				break;
+			}
+		}
+	}
+	indexworker(&job);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	return job.scans;
+}
+
+double
+elapsedms(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e3 +
+	    (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Build the whole name-to-path table up front (--pathindex), so that a
+ * lookup is a hash probe and nothing else. Directories are listed by a
+ * few threads when PATH is long, and merged in PATH order so the first
+ * directory holding a name wins, exactly as findcommandinpath() would.
+ */
+void
+buildindex(PathTable *table)
+{
+	struct timespec start;
+	char path[PATH_MAX];
+	DirScan *scans;
+	char *name;
+	uint64_t hash;
+	int i;
+
+	table->indexed = 1;
+	table->nindexed = 0;
+	if (table->relative) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	scans = scanpath(table);
+	for (i = 0; i < table->ndirs; i++) {
+		name = scans[i].names;
+		for (; name < scans[i].names + scans[i].len;
+		     name += strlen(name) + 1) {
+			hash = hashline(name, strlen(name));
+			if (lookuppath(table, name, hash) != NULL) {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s",
+				 table->dirs[i].name, name);
+			insertpath(table, name, hash, path);
+			table->nindexed++;
+		}
+		free(scans[i].names);
+	}
+	free(scans);
+	table->indextime = elapsedms(&start);
+}
+
+void
+shmpath(char *buf, size_t size)
+{
+	char *path = getvar("PATH");
+
+	snprintf(buf, size, "/dev/shm/shell-index-%u-%016llx",
+		 (unsigned)getuid(),
+		 (unsigned long long)hashline(path, strlen(path)));
+}
+
+ShmEntry *
+shmentries(char *base)
+{
+	return (ShmEntry *)(base + ((ShmHeader *)base)->entries);
+}
+
+uint32_t *
+shmbuckets(char *base)
+{
+	return (uint32_t *)(base + ((ShmHeader *)base)->buckets);
+}
+
+char *
+lookupshm(char *base, char *command, uint64_t hash)
+{
+	ShmHeader *header = (ShmHeader *)base;
+	ShmEntry *entries = shmentries(base);
+	uint32_t i;
+
+	i = shmbuckets(base)[hash % header->nbuckets];
+	for (; i != 0; i = entries[i - 1].next) {
+		if (entries[i - 1].hash == hash &&
+		    strcmp(base + entries[i - 1].name, command) == 0) {
+			return base + entries[i - 1].path;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Lay the scanned PATH out as one position-independent block: header,
+ * directories with the mtimes seen before they were listed, a bucket
+ * array, chained entries and a string pool, all linked by offsets.
+ */
+void
+buildshm(PathTable *table, DirScan *scans, Buffer *out)
+{
+	char *pathenv = getvar("PATH");
+	char path[PATH_MAX];
+	ShmHeader header;
+	ShmDir *dirs;
+	ShmEntry *entries;
+	ShmEntry entry;
+	uint32_t *buckets;
+	Buffer strings;
+	Buffer chain;
+	uint32_t nbuckets;
+	uint32_t nentries = 0;
+	uint32_t prev;
+	uint32_t k;
+	size_t base;
+	char *name;
+	int i;
+
+	initbuffer(&strings);
+	initbuffer(&chain);
+	nbuckets = PATH_BUCKETS;
+	for (i = 0; i < table->ndirs; i++) {
+		nbuckets += scans[i].len / 8;
+	}
+	nbuckets += nbuckets & 1;
+	buckets = calloc(nbuckets, sizeof(uint32_t));
+	dirs = calloc(table->ndirs + 1, sizeof(ShmDir));
+	if (buckets == NULL || dirs == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	bufappend(&strings, "", 1);
+	for (i = 0; i < table->ndirs; i++) {
+		dirs[i].mtimesec = scans[i].mtime.tv_sec;
+		dirs[i].mtimensec = scans[i].mtime.tv_nsec;
+		dirs[i].name = bufappend(&strings, table->dirs[i].name,
+					 strlen(table->dirs[i].name) + 1);
+		name = scans[i].names;
+		for (; name < scans[i].names + scans[i].len;
+		     name += strlen(name) + 1) {
+			memset(&entry, 0, sizeof(entry));
+			entry.hash = hashline(name, strlen(name));
+			entries = (ShmEntry *)chain.data;
+			prev = 0;
+			k = buckets[entry.hash % nbuckets];
+			while (k != 0 &&
+			       strcmp(strings.data + entries[k - 1].name,
+				      name) != 0) {
+				prev = k;
+				k = entries[k - 1].next;
+			}
+			if (k != 0) {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s",
+				 table->dirs[i].name, name);
+			entry.name = bufappend(&strings, name,
+					       strlen(name) + 1);
+			entry.path = bufappend(&strings, path,
+					       strlen(path) + 1);
+			entry.next = 0;
+			bufappend(&chain, &entry, sizeof(entry));
+			if (prev == 0) {
+				buckets[entry.hash % nbuckets] = ++nentries;
+			} else {
+				entries = (ShmEntry *)chain.data;
+				entries[prev - 1].next = ++nentries;
+			}
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "SHELLIDX", sizeof(header.magic));
+	header.version = SHM_VERSION;
+	header.ndirs = table->ndirs;
+	header.nbuckets = nbuckets;
+	header.nentries = nentries;
+	header.dirs = sizeof(header);
+	header.buckets = header.dirs + table->ndirs * sizeof(ShmDir);
+	header.entries = header.buckets + nbuckets * sizeof(uint32_t);
+	base = header.entries + chain.len;
+	header.path = base + bufappend(&strings, pathenv,
+				       strlen(pathenv) + 1);
+	header.size = base + strings.len;
+
+	for (i = 0; i < table->ndirs; i++) {
+		dirs[i].name += base;
+	}
+	entries = (ShmEntry *)chain.data;
+	for (i = 0; i < nentries; i++) {
+		entries[i].name += base;
+		entries[i].path += base;
+	}
+
+	initbuffer(out);
+	bufappend(out, &header, sizeof(header));
+	bufappend(out, dirs, table->ndirs * sizeof(ShmDir));
+	bufappend(out, buckets, nbuckets * sizeof(uint32_t));
+	bufappend(out, chain.data, chain.len);
+	bufappend(out, strings.data, strings.len);
+
+	free(buckets);
+	free(dirs);
+	free(chain.data);
+	free(strings.data);
+}
+
+/*
+ * A snapshot is usable when it was built for this exact PATH and no
+ * directory has changed since it was listed. Snapshots are never
+ * modified in place, so this check and every later lookup read it
+ * without any locking.
+ */
+int
+validshm(PathTable *table, char *base, size_t size)
+{
+	ShmHeader *header = (ShmHeader *)base;
+	ShmDir *dirs;
+	struct stat st;
+	int i;
+
+	if (size < sizeof(ShmHeader) ||
+	    memcmp(header->magic, "SHELLIDX", sizeof(header->magic)) != 0 ||
+	    header->version != SHM_VERSION || header->size != size ||
+	    __atomic_load_n(&header->stale, __ATOMIC_ACQUIRE) ||
+	    header->ndirs != table->ndirs ||
+	    strcmp(base + header->path, getvar("PATH")) != 0) {
+		return 0;
+	}
+	dirs = (ShmDir *)(base + header->dirs);
+	for (i = 0; i < table->ndirs; i++) {
+		if (table->dirs[i].fd == -1 ||
+		    fstat(table->dirs[i].fd, &st) == -1) {
+			memset(&st.st_mtim, 0, sizeof(st.st_mtim));
+		}
+		if (strcmp(base + dirs[i].name, table->dirs[i].name) != 0 ||
+		    st.st_mtim.tv_sec != dirs[i].mtimesec ||
+		    st.st_mtim.tv_nsec != dirs[i].mtimensec) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int
+mapshm(PathTable *table, char *name)
+{
+	struct stat st;
+	char *base;
+	int fd;
+
+	fd = open(name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) {
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || st.st_uid != getuid() ||
+	    (st.st_mode & 077) != 0 || st.st_size < sizeof(ShmHeader)) {
+		close(fd);
+		return 0;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return 0;
+	}
+	table->shm = base;
+	table->shmsize = st.st_size;
+	return 1;
+}
+
+/*
+ * Rebuild the snapshot and publish it by renaming it over the old one,
+ * then flag the old one stale so that shells still mapping it switch
+ * to the new file on their next lookup.
+ */
+void
+publishshm(PathTable *table, char *name)
+{
+	struct timespec start;
+	char tmp[PATH_MAX];
+	DirScan *scans;
+	Buffer out;
+	ssize_t n;
+	int fd;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	scans = scanpath(table);
+	buildshm(table, scans, &out);
+	for (i = 0; i < table->ndirs; i++) {
+		free(scans[i].names);
+	}
+	free(scans);
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", name, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		free(out.data);
+		return;
+	}
+	n = write(fd, out.data, out.len);
+	close(fd);
+	free(out.data);
+	if (n != out.len || rename(tmp, name) == -1) {
+		unlink(tmp);
+		return;
+	}
+
+	if (table->shm != NULL) {
+		__atomic_store_n(&((ShmHeader *)table->shm)->stale, 1,
+				 __ATOMIC_RELEASE);
+		detachshm(table);
+	}
+	if (mapshm(table, name)) {
+		table->nindexed = ((ShmHeader *)table->shm)->nentries;
+		table->indextime = elapsedms(&start);
+	}
+}
+
+/*
+ * Attach the shared index for the current PATH (--shmindex), building
+ * it when no other shell has yet or when the one found is stale.
+ */
+void
+attachshm(PathTable *table)
+{
+	char name[PATH_MAX];
+
+	if (table->relative || getvar("PATH") == NULL) {
+		return;
+	}
+	if (table->shm != NULL) {
+		if (table->shmdirgen == table->dirgen &&
+		    !__atomic_load_n(&((ShmHeader *)table->shm)->stale,
+				     __ATOMIC_ACQUIRE)) {
+			return;
+		}
+		detachshm(table);
+	}
+
+	shmpath(name, sizeof(name));
+	table->shmdirgen = table->dirgen;
+	if (mapshm(table, name)) {
+		if (validshm(table, table->shm, table->shmsize)) {
+			table->nindexed = ((ShmHeader *)table->shm)->nentries;
+			table->indextime = 0;
+			return;
+		}
+	}
+	publishshm(table, name);
+}
+
+/*
+ * Resolve argv[0] in the shell itself so the result outlives the child.
+ * Paths and executables in the current directory are used as they are;
+ * anything else is searched in PATH once and remembered until PATH is
+ * assigned again or "hash -r" is run. Misses are remembered as entries
+ * without a path, valid while no PATH directory has changed. The shared
+ * snapshot is only a hint: a hit is used once access() agrees and a
+ * miss is checked against PATH. Relative
+ * PATH entries depend on the working directory, so their results are
+ * not remembered.
+ */
+char *
+resolvecommand(PathTable *table, Arena *arena, char **tokens)
+{
+	PathEntry *entry;
+	int shmstale = 0;
+	int shmmiss = 0;
+	uint64_t hash;
+	char *local;
+	char *path;
+
+	if (islocalcommand(tokens[0])) {
+		if (dotandslash(tokens[0]) && tokens[0][2] != '\0') {
+			tokens[0] += 2;
+		}
+		return tokens[0];
+	}
+
+	checkdirs(table);
+	readwatches(table);
+	if (table->index && !table->indexed) {
+		buildindex(table);
+	}
+	hash = hashline(tokens[0], strlen(tokens[0]));
+	entry = lookuppath(table, tokens[0], hash);
+	if (entry == NULL && table->shared) {
+		attachshm(table);
+		if (table->shm != NULL) {
+			path = lookupshm(table->shm, tokens[0], hash);
+			if (path == NULL) {
+				shmmiss = 1;
+			} else if (access(path, X_OK) == 0) {
+				entry = insertpath(table, tokens[0], hash,
+						   path);
+			} else {
+				shmstale = 1;
+			}
+		}
+	}
+	if (entry != NULL && entry->path == NULL) {
+		if (entry->dirgen != table->dirgen) {
+			droppath(table, tokens[0]);
+			entry = NULL;
+		}
+	}
+	if (entry == NULL) {
+		path = findcommandinpath(table, tokens[0]);
+		if (path != NULL && path[0] != '/') {
+			local = arenastrdup(arena, path);
+			free(path);
+			return local;
+		}
+		if (path == NULL && table->relative) {
+			fprintf(stderr, "Command not found in PATH: %s\n",
+				tokens[0]);
+			return NULL;
+		}
+		if (shmstale || (path != NULL && shmmiss)) {
+			// A chmod or a binary replaced in place leaves the
+			// directory mtimes alone: flag the snapshot stale
+			// so that the next lookup republishes it.
+			__atomic_store_n(&((ShmHeader *)table->shm)->stale,
+					 1, __ATOMIC_RELEASE);
+		}
+		entry = insertpath(table, tokens[0], hash, path);
+		free(path);
+	}
+	entry->hits++;
+	if (entry->path == NULL) {
+		fprintf(stderr, "Command not found in PATH: %s\n", tokens[0]);
+	}
+	return entry->path;
+}
+
+int
+openredirect(char *file, int flags)
+{
+	int fd;
+
+	fd = open(file, flags | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror("open");
+	}
+	return fd;
+}
+
+/*
+ * Heredoc bodies go into an anonymous memory file rather than a pipe,
+ * so the body is written before the child exists and can be any size.
+ */
+int
+heredocfd(HereDoc *heredoc)
+{
+	int fd;
+
+	fd = memfd_create("heredoc", MFD_CLOEXEC);
+	if (fd == -1) {
+		perror("memfd_create");
+		return -1;
+	}
+	if (write(fd, heredoc->lines, heredoc->size) != heredoc->size ||
+	    lseek(fd, 0, SEEK_SET) == -1) {
+		perror("write");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void
+closelaunch(Launch *launch)
+{
+	int i;
+
+	for (i = 0; i < NSTDFDS; i++) {
+		if (launch->fds[i] != -1) {
+			close(launch->fds[i]);
+			launch->fds[i] = -1;
+		}
+	}
+}
+
+/*
+ * Open everything the child's standard descriptors are replaced with,
+ * in the shell, so that every spawn engine only has to dup them.
+ */
+int
+preparelaunch(Launch *launch, Stage *stage, HereDoc *heredoc,
+	      int background)
+{
+	Redirection *redir = stage->redir;
+	int needinput = 1;
+	int i;
+
+	for (i = 0; i < NSTDFDS; i++) {
+		launch->fds[i] = -1;
+	}
+	launch->argv = stage->argv;
+
+	if (redir->isinputredirect) {
+		if (access(redir->inputfile, R_OK) != 0) {
+			perror("access");
+			return -1;
+		}
+		launch->fds[STDIN_FILENO] = openredirect(redir->inputfile,
+							 O_RDONLY);
+	} else if (herecommand(stage)) {
+		launch->fds[STDIN_FILENO] = heredocfd(heredoc);
+	} else if (background) {
+		launch->fds[STDIN_FILENO] = openredirect("/dev/null", O_RDONLY);
+	} else {
+		needinput = 0;
+	}
+	if (needinput && launch->fds[STDIN_FILENO] == -1) {
+		return -1;
+	}
+
+	if (redir->isoutputredirect) {
+		launch->fds[STDOUT_FILENO] = openredirect(redir->outputfile,
+							  O_WRONLY | O_CREAT |
+							  O_TRUNC);
+		if (launch->fds[STDOUT_FILENO] == -1) {
+			closelaunch(launch);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void
+childerror(char *what)
+{
+	char *msg = strerror(errno);
+
+	if (write(STDERR_FILENO, what, strlen(what)) == -1 ||
+	    write(STDERR_FILENO, ": ", 2) == -1 ||
+	    write(STDERR_FILENO, msg, strlen(msg)) == -1 ||
+	    write(STDERR_FILENO, "\n", 1) == -1) {
+		_exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Runs in the child of fork() and vfork(): only descriptor moves and the
+ * exec itself, so it is safe while still sharing the shell's memory.
+ * The shell's SIGINT handler uses stdio, so it is reset before the mask
+ * is cleared; spawnvfork() keeps SIGINT blocked until then.
+ */
+void
+execlaunch(Launch *launch)
+{
+	sigset_t mask;
+	int i;
+
+	signal(SIGINT, SIG_DFL);
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	for (i = 0; i < NSTDFDS; i++) {
+		if (launch->fds[i] != -1 && dup2(launch->fds[i], i) == -1) {
+			childerror("dup2");
+			_exit(EXIT_FAILURE);
+		}
+	}
+	execve(launch->path, launch->argv, launch->envp);
+	childerror("execv");
+	_exit(EXIT_FAILURE);
+}
+
+pid_t
+spawnfork(Launch *launch)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid == 0) {
+		execlaunch(launch);
+	}
+	return pid;
+}
+
+pid_t
+spawnvfork(Launch *launch)
+{
+	sigset_t oldmask;
+	sigset_t mask;
+	pid_t pid;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	pid = vfork();
+	if (pid == 0) {
+		execlaunch(launch);
+	}
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	return pid;
+}
+
+pid_t
+spawnposix(Launch *launch)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t pid;
+	int err;
+	int i;
+
+	posix_spawn_file_actions_init(&actions);
+	for (i = 0; i < NSTDFDS; i++) {
+		if (launch->fds[i] != -1) {
+			posix_spawn_file_actions_adddup2(&actions,
+							 launch->fds[i], i);
+		}
+	}
+	sigemptyset(&mask);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	err = posix_spawn(&pid, launch->path, &actions, &attr, launch->argv,
+			  launch->envp);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err != 0) {
+		errno = err;
+		perror("execv");
+		changeresult(EXIT_FAILURE);
+		return 0;
+	}
+	return pid;
+}
+
+void
+zygotereply(int sock, int kind, pid_t pid, int status,
+	    struct rusage *usage)
+{
+	ZygoteReply reply;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.kind = kind;
+	reply.pid = pid;
+	reply.status = status;
+	if (usage != NULL) {
+		reply.usage = *usage;
+	}
+	if (writefull(sock, &reply, sizeof(reply)) == -1) {
+		_exit(EXIT_FAILURE);
+	}
+}
+
+void
+zygotereap(int sock)
+{
+	struct rusage usage;
+	int status;
+	pid_t pid;
+
+	while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+		zygotereply(sock, ZYGOTE_EXITED, pid, status, &usage);
+	}
+}
+
+char **
+zygotestrings(char **p, char *end, uint32_t n)
+{
+	char **vec;
+	uint32_t i;
+
+	vec = malloc((n + 1) * sizeof(char *));
+	if (vec == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < n && *p < end; i++) {
+		vec[i] = *p;
+		*p += strlen(*p) + 1;
+	}
+	vec[i] = NULL;
+	return vec;
+}
+
+/*
+ * Receive one launch, fork and exec it. The descriptors arrive
+ * close-on-exec, so the child only keeps what it dup2()s onto 0-2.
+ * Returns 0 when the shell has closed its end.
+ */
+int
+zygoteserve(int sock, sigset_t *oldmask)
+{
+	char control[CMSG_SPACE((NSTDFDS + 1) * sizeof(int))];
+	int fds[NSTDFDS + 1];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ZygoteRequest req;
+	Launch launch;
+	char **envp = NULL;
+	char *body = NULL;
+	char *p;
+	int nfds = 0;
+	int next = 1;
+	pid_t pid = -1;
+	ssize_t n;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	do {
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n == -1 && errno == EINTR);
+	if (n <= 0) {
+		return 0;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+		}
+	}
+	if ((size_t)n < sizeof(req) &&
+	    readfull(sock, (char *)&req + n, sizeof(req) - n) == -1) {
+		return 0;
+	}
+	body = malloc(req.size + 1);
+	if (body == NULL || readfull(sock, body, req.size) == -1) {
+		free(body);
+		return 0;
+	}
+	body[req.size] = '\0';
+
+	launch.path = body;
+	p = body + strlen(body) + 1;
+	launch.argv = zygotestrings(&p, body + req.size, req.argc);
+	envp = zygotestrings(&p, body + req.size, req.envc);
+	for (i = 0; i < NSTDFDS; i++) {
+		launch.fds[i] = -1;
+		if ((req.fdmask & (1 << i)) && next < nfds) {
+			launch.fds[i] = fds[next++];
+		}
+	}
+
+	errno = ENOMEM;
+	if (nfds > 0 && launch.argv != NULL && envp != NULL) {
+		pid = fork();
+	}
+	if (pid == 0) {
+		sigprocmask(SIG_SETMASK, oldmask, NULL);
+		signal(SIGINT, SIG_DFL);
+		if (fchdir(fds[0]) == -1) {
+			childerror("fchdir");
+			_exit(EXIT_FAILURE);
+		}
+		launch.envp = envp;
+		execlaunch(&launch);
+	}
+	zygotereply(sock, ZYGOTE_STARTED, pid, pid == -1 ? errno : 0, NULL);
+
+	for (i = 0; i < nfds; i++) {
+		close(fds[i]);
+	}
+	free(launch.argv);
+	free(envp);
+	free(body);
+	return 1;
+}
+
+/*
+ * The zygote's whole life: wait for launches on the socket and for
+ * SIGCHLD, and report every start and exit back to the shell. SIGINT
+ * is ignored here so that ^C only reaches the commands themselves.
+ */
+void
+zygotemain(int sock)
+{
+	struct signalfd_siginfo info;
+	struct pollfd pfd[2];
+	sigset_t oldmask;
+	sigset_t mask;
+
+	signal(SIGINT, SIG_IGN);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	pfd[1].events = POLLIN;
+	if (pfd[1].fd == -1) {
+		_exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			_exit(EXIT_FAILURE);
+		}
+		if (pfd[1].revents & POLLIN) {
+			while (read(pfd[1].fd, &info, sizeof(info)) > 0) {
+				;
+			}
+			zygotereap(sock);
+		}
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (zygoteserve(sock, &oldmask) == 0) {
+				_exit(EXIT_SUCCESS);
+			}
+		}
+	}
+}
+
+/*
+ * Fork the zygote before the shell builds any state of its own, so
+ * that every later fork() copies an address space that never grows.
+ */
+int
+startzygote(Zygote *z)
+{
+	int sv[2];
+	pid_t pid;
+
+	initbuffer(&z->request);
+	z->exits = NULL;
+	z->nexits = 0;
+	z->size = 0;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+	fflush(NULL);
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		zygotemain(sv[1]);
+	}
+	close(sv[1]);
+	z->sock = sv[0];
+	z->pid = pid;
+	return 0;
+}
+
+void
+stopzygote(Zygote *z)
+{
+	close(z->sock);
+	waitpid(z->pid, NULL, 0);
+	free(z->request.data);
+	free(z->exits);
+}
+
+int
+sendlaunch(Zygote *z, Launch *launch)
+{
+	char control[CMSG_SPACE((NSTDFDS + 1) * sizeof(int))];
+	int fds[NSTDFDS + 1];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov[2];
+	ZygoteRequest req;
+	size_t sent;
+	ssize_t n;
+	int nfds = 0;
+	int i;
+
+	z->request.len = 0;
+	bufappend(&z->request, launch->path, strlen(launch->path) + 1);
+	for (req.argc = 0; launch->argv[req.argc] != NULL; req.argc++) {
+		bufappend(&z->request, launch->argv[req.argc],
+			  strlen(launch->argv[req.argc]) + 1);
+	}
+	for (req.envc = 0; launch->envp[req.envc] != NULL; req.envc++) {
+		bufappend(&z->request, launch->envp[req.envc],
+			  strlen(launch->envp[req.envc]) + 1);
+	}
+	req.size = z->request.len;
+	req.fdmask = 0;
+
+	fds[nfds] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fds[nfds++] == -1) {
+		perror("open");
+		return -1;
+	}
+	for (i = 0; i < NSTDFDS; i++) {
+		if (launch->fds[i] != -1) {
+			req.fdmask |= 1 << i;
+			fds[nfds++] = launch->fds[i];
+		}
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = z->request.data;
+	iov[1].iov_len = z->request.len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	do {
+		n = sendmsg(z->sock, &msg, MSG_NOSIGNAL);
+	} while (n == -1 && errno == EINTR);
+	close(fds[0]);
+	if (n == -1) {
+		perror("sendmsg");
+		return -1;
+	}
+	sent = n;
+	if (sent < sizeof(req)) {
+		if (writefull(z->sock, (char *)&req + sent,
+			      sizeof(req) - sent) == -1) {
+			perror("write");
+			return -1;
+		}
+		sent = sizeof(req);
+	}
+	if (writefull(z->sock, z->request.data + (sent - sizeof(req)),
+		      z->request.len - (sent - sizeof(req))) == -1) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Hand the launch to the zygote and wait for it to report the pid.
+ * Exits of earlier commands that arrive first are queued.
+ */
+pid_t
+spawnzygote(Zygote *z, Launch *launch)
+{
+	ZygoteReply reply;
+	int kind;
+
+	if (sendlaunch(z, launch) == -1) {
+		return -1;
+	}
+	while ((kind = nextreply(z, &reply)) != ZYGOTE_STARTED) {
+		if (kind == -1) {
+			return -1;
+		}
+		queueexit(z, &reply);
+	}
+	if (reply.pid == -1) {
+		errno = reply.status;
+	}
+	return reply.pid;
 }
 
-void
-redirectoutput(char *output_file)
+/*
+ * Launch a resolved command with the selected engine. fork() copies the
+ * shell's page tables, which grows with its heap; vfork() and
+ * posix_spawn() borrow the shell's memory until the exec instead, and
+ * the zygote forks from a small helper started before the shell grew.
+ * Returns the child's pid, 0 when posix_spawn() already reported that
+ * the command could not be run, or -1 when no process was created.
+ */
+pid_t
+spawnlaunch(Spawner *spawner, Launch *launch)
 {
-	int fd;
-
-	fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd == -1) {
-		perror("open");
-		exit(EXIT_FAILURE);
+	switch (spawner->engine) {
+	case SPAWN_VFORK:
+		return spawnvfork(launch);
+	case SPAWN_POSIX:
+		return spawnposix(launch);
+	case SPAWN_ZYGOTE:
+		return spawnzygote(&spawner->zygote, launch);
+	default:
+		return spawnfork(launch);
 	}
-	dup2(fd, STDOUT_FILENO);
-	close(fd);
 }
 
+
+/*
+ * Join neighbouring stages with close-on-exec pipes. A stage's own
+ * redirection or heredoc wins over the pipe, whose end is then closed
+ * so that the other side still sees EOF or EPIPE.
+ */
 int
-manageredirectinput(Redirection *redir, int background)
+connectstages(Launch *launches, int n)
 {
-	if (redir->isinputredirect) {
-		if (canacces(redir->inputfile)) {
-			perror("access");
+	int pipefd[2];
+	int i;
+
+	for (i = 0; i < n - 1; i++) {
+		if (pipe2(pipefd, O_CLOEXEC) == -1) {
+			perror("pipe");
 			return -1;
 		}
-		redirectinput(redir->inputfile);
-	} else if (background) {
-		redirectinput("/dev/null");
+		if (launches[i].fds[STDOUT_FILENO] == -1) {
+			launches[i].fds[STDOUT_FILENO] = pipefd[1];
+		} else {
+			close(pipefd[1]);
+		}
+		if (launches[i + 1].fds[STDIN_FILENO] == -1) {
+			launches[i + 1].fds[STDIN_FILENO] = pipefd[0];
+		} else {
+			close(pipefd[0]);
+		}
 	}
-
 	return 0;
 }
 
-int
-manageredirectoutput(Redirection *redir)
+/*
+ * Wait for every stage of a foreground pipeline. The stages are
+ * collected by the event loop, which keeps reporting background jobs
+ * meanwhile.
+ */
+void
+waitstages(Spawner *spawner, pid_t *pids, int *statuses, int n)
 {
+	Events *ev = spawner->events;
+	int i;
 
-	if (redir->isoutputredirect) {
-		redirectoutput(redir->outputfile);
+	ev->fg = pids;
+	ev->fgstatus = statuses;
+	ev->nfg = n;
+	ev->pending = 0;
+	for (i = 0; i < n; i++) {
+		if (pids[i] > 0) {
+			ev->pending++;
+		}
 	}
-
-	return 0;
+	flushzygote(ev);
+	while (ev->pending > 0) {
+		dispatchevents(ev, -1);
+	}
+	ev->nfg = 0;
+	changeresult(pipelinecode(statuses, n, spawner->pipefail));
 }
 
-int
-ishere(char **tokens)
+/*
+ * The command line a job is listed with, rebuilt from the expanded
+ * stages so that it also exists for lines loaded from an image.
+ */
+char *
+joinstages(LineToken *lt)
 {
+	size_t len = sizeof(" &");
+	char *line;
+	char **argv;
 	int i;
 
-	for (i = 0; tokens[i] != NULL; i++) {
-		if (strcmp(tokens[i], "HERE{") == 0) {
-			return 1;
+	for (i = 0; i < lt->nstages; i++) {
+		for (argv = lt->stages[i].argv; *argv != NULL; argv++) {
+			len += strlen(*argv) + sizeof(" | ");
 		}
 	}
-	return 0;
+	line = arenaalloc(lt->arena, len);
+	line[0] = '\0';
+	for (i = 0; i < lt->nstages; i++) {
+		if (i > 0) {
+			strcat(line, " |");
+		}
+		for (argv = lt->stages[i].argv; *argv != NULL; argv++) {
+			if (line[0] != '\0') {
+				strcat(line, " ");
+			}
+			strcat(line, *argv);
+		}
+	}
+	strcat(line, " &");
+	return line;
 }
 
-int
-noredirects(Redirection *redir)
+/*
+ * The environment of a stage with NAME=value words in front: a copy
+ * of the cached envp's pointers with those words swapped in or, for
+ * names not in it, appended. The words are used as they are, so the
+ * array is the only allocation and the shell's variables stay as
+ * they were.
+ */
+char **
+overlayenv(Arena *arena, char **envp, Stage *stage)
 {
-	return !redir->isinputredirect && !redir->isoutputredirect;
+	char **overlay;
+	size_t namelen;
+	char *eq;
+	Var *var;
+	int n = shellvars.nenv;
+	int i;
+	int j;
+
+	overlay = arenaalloc(arena, (n + stage->nassign + 1) *
+			     sizeof(char *));
+	memcpy(overlay, envp, n * sizeof(char *));
+	for (i = 0; i < stage->nassign; i++) {
+		eq = strchr(stage->assign[i], '=');
+		namelen = eq - stage->assign[i];
+		var = findvar(stage->assign[i], namelen);
+		if (var != NULL && var->slot != -1) {
+			overlay[var->slot] = stage->assign[i];
+			continue;
+		}
+		for (j = shellvars.nenv; j < n; j++) {
+			if (strncmp(overlay[j], stage->assign[i],
+				    namelen + 1) == 0) {
+				break;
+			}
+		}
+		overlay[j] = stage->assign[i];
+		if (j == n) {
+			n++;
+		}
+	}
+	overlay[n] = NULL;
+	return overlay;
 }
 
-int
-herecommand(char **tokens, Redirection *redir)
+/*
+ * Resolve argv[0] of a stage. A PATH=value word in front of it changes
+ * the search for that command alone, so such a lookup goes through the
+ * value itself and is not remembered.
+ */
+char *
+resolvestage(PathTable *table, Arena *arena, Stage *stage)
 {
-	return ishere(tokens) && noredirects(redir);
+	char *pathvar = NULL;
+	char *local;
+	char *path;
+	int i;
+
+	for (i = 0; i < stage->nassign; i++) {
+		if (strncmp(stage->assign[i], "PATH=", 5) == 0) {
+			pathvar = stage->assign[i] + 5;
+		}
+	}
+	if (pathvar == NULL || islocalcommand(stage->argv[0])) {
+		return resolvecommand(table, arena, stage->argv);
+	}
+	path = searchpathstring(pathvar, stage->argv[0]);
+	if (path == NULL) {
+		fprintf(stderr, "Command not found in PATH: %s\n",
+			stage->argv[0]);
+		return NULL;
+	}
+	local = arenastrdup(arena, path);
+	free(path);
+	return local;
 }
 
+/*
+ * Start every stage of the line before waiting for any of them. All
+ * commands are resolved and all files opened first, so a pipeline that
+ * cannot run as a whole does not run at all.
+ */
 void
-readheredoc(HereDoc *heredoc)
+startprocess(Spawner *spawner, PathTable *table, LineToken *lt,
+	     HereDoc *heredoc)
 {
-	char heredoc_line[MAX_LINE];
-	size_t len;
-
-	heredoc->lines = NULL;
-	heredoc->size = 0;
+	int n = lt->nstages;
+	Launch *launches;
+	char **envp;
+	pid_t *pids;
+	int *statuses;
+	int background;
+	Job *job;
+	int i;
 
-	while (fgets(heredoc_line, sizeof(heredoc_line), stdin) != NULL) {
-		if (strcmp(heredoc_line, "}\n") == 0) {
-			break;
+	envp = buildenv();
+	background = lt->cmd->background;
+	launches = arenaalloc(lt->arena, n * sizeof(Launch));
+	pids = arenaalloc(lt->arena, n * sizeof(pid_t));
+	statuses = arenaalloc(lt->arena, n * sizeof(int));
+
+	for (i = 0; i < n; i++) {
+		launches[i].envp = envp;
+		if (lt->stages[i].nassign > 0) {
+			launches[i].envp = overlayenv(lt->arena, envp,
+						      &lt->stages[i]);
 		}
-		len = strlen(heredoc_line);
-		heredoc->size += len;
-		heredoc->lines = realloc(heredoc->lines, heredoc->size + 1);
-		if (heredoc->lines == NULL) {
-			perror("realloc");
-			exit(EXIT_FAILURE);
+		launches[i].path = resolvestage(table, lt->arena,
+						&lt->stages[i]);
+		if (launches[i].path == NULL) {
+			changeresult(1);
+			return;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (preparelaunch(&launches[i], &lt->stages[i], heredoc,
+				  background && i == 0) == -1) {
+			break;
 		}
-		if (heredoc->size == len) {
-			heredoc->lines[0] = '\0';
+	}
+	if (i < n || connectstages(launches, n) == -1) {
+		while (i-- > 0) {
+			closelaunch(&launches[i]);
 		}
-		strcat(heredoc->lines, heredoc_line);
+		changeresult(1);
+		return;
+	}
 
+	for (i = 0; i < n; i++) {
+		statuses[i] = -1;
+		pids[i] = spawnlaunch(spawner, &launches[i]);
+		closelaunch(&launches[i]);
+		if (pids[i] == -1) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
 	}
 
+	if (background) {
+		job = addjob(spawner->events->jobs, pids, n,
+			     joinstages(lt));
+		printf("[%d] %d\n", job->number, pids[n - 1]);
+	} else {
+		waitstages(spawner, pids, statuses, n);
+	}
 }
 
-void
-redirectheredoc(HereDoc *heredoc)
+char *
+imagepath(char *script)
 {
-	int pipefd[2];
+	char *path = malloc(strlen(script) + sizeof(".shc"));
 
-	if (pipe(pipefd) == -1) {
-		perror("pipe");
-		exit(EXIT_FAILURE);
-	}
-
-	if (write(pipefd[1], heredoc->lines, heredoc->size) == -1) {
-		perror("write");
+	if (path == NULL) {
+		perror("malloc");
 		exit(EXIT_FAILURE);
 	}
-
-	close(pipefd[1]);
-	dup2(pipefd[0], STDIN_FILENO);
-	close(pipefd[0]);
-
-	free(heredoc->lines);
-
+	sprintf(path, "%s.shc", script);
+	return path;
 }
 
-void
-manageheredoc(LineToken *lt, HereDoc *heredoc)
+uint64_t
+hashinput(Input *in)
 {
-	readheredoc(heredoc);
-	redirectheredoc(heredoc);
-	erasetoken(lt->tokens, "HERE{");
-
+	return hashline(in->buf, in->iswhole ? in->end : 0);
 }
 
 void
-handleredirections(LineToken *lt, Redirection *redir, HereDoc *heredoc,
-		   int background)
+compilecommand(Buffer *records, Buffer *tokens, Buffer *strings,
+	       LineToken *lt, HereDoc *heredoc)
 {
-	identifyredirections(lt->tokens, redir);
+	ImageRecord rec;
+	ImageToken tok;
+	Command *cmd = lt->cmd;
+	int i;
 
-	if (manageredirectinput(redir, background) == -1) {
-		freeall(lt, redir, heredoc);
-		exit(EXIT_FAILURE);
+	memset(&rec, 0, sizeof(rec));
+	rec.tokens = tokens->len / sizeof(ImageToken);
+	rec.ntokens = cmd->ntokens;
+	rec.nwords = cmd->nwords;
+	rec.condition = cmd->condition;
+	rec.builtin = cmd->builtin;
+	rec.background = cmd->background;
+	rec.npipes = cmd->npipes;
+	rec.hasheredoc = cmd->heredoc;
+	if (cmd->heredoc) {
+		rec.heredoc = bufappend(strings, heredoc->lines,
+					heredoc->size);
+		rec.heredocsize = heredoc->size;
 	}
 
-	manageredirectoutput(redir);
-
-	if (herecommand(lt->tokens, redir)) {
-		manageheredoc(lt, heredoc);
+	for (i = 0; i < cmd->ntokens; i++) {
+		memset(&tok, 0, sizeof(tok));
+		tok.text = bufappend(strings, cmd->tokens[i].text,
+				     strlen(cmd->tokens[i].text) + 1);
+		tok.kind = cmd->tokens[i].kind;
+		tok.flags = cmd->tokens[i].flags;
+		bufappend(tokens, &tok, sizeof(tok));
 	}
+	bufappend(records, &rec, sizeof(rec));
 }
 
 int
-islocalcommand(char *command)
+writeimage(char *script, ImageHeader *header, Buffer *records,
+	   Buffer *tokens, Buffer *strings)
 {
-	return strncmp(command, "./", 2) == 0 || access(command, X_OK) == 0;
+	char *path = imagepath(script);
+	char tmp[PATH_MAX];
+	FILE *f;
+	int ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		perror(tmp);
+		free(path);
+		return -1;
+	}
+	ok = fwrite(header, sizeof(*header), 1, f) == 1 &&
+	    fwrite(records->data, 1, records->len, f) == records->len &&
+	    fwrite(tokens->data, 1, tokens->len, f) == tokens->len &&
+	    fwrite(strings->data, 1, strings->len, f) == strings->len;
+	if (fclose(f) != 0 || !ok || rename(tmp, path) == -1) {
+		perror(path);
+		unlink(tmp);
+		free(path);
+		return -1;
+	}
+	free(path);
+	return 0;
 }
 
+/*
+ * Parse the whole script once and store the result next to it as
+ * <script>.shc. Only the lexing is done ahead of time: expansion,
+ * conditions and execution still happen when the image is run.
+ */
 int
-dotandslash(char *token)
-{
-	return token[0] == '.' && token[1] == '/';
-}
-
-void
-removedotslash(char *token)
+compilescript(char *script)
 {
-	int i;
-	int len;
+	ImageHeader header;
+	Buffer records;
+	Buffer tokens;
+	Buffer strings;
+	HereDoc heredoc;
+	struct stat st;
+	LineToken *lt;
+	Arena arena;
+	Input in;
+	char *line;
+	int fd;
+	int result;
 
-	len = strlen(token);
-	for (i = 0; i < len - 1; i++) {
-		token[i] = token[i + 2];
+	fd = open(script, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(script);
+		return -1;
+	}
+	openinput(&in, fd, 0);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "SHELLIMG", sizeof(header.magic));
+	header.version = IMAGE_VERSION;
+	header.scriptsize = st.st_size;
+	header.mtimesec = st.st_mtim.tv_sec;
+	header.mtimensec = st.st_mtim.tv_nsec;
+	header.hash = hashinput(&in);
+
+	initbuffer(&records);
+	initbuffer(&tokens);
+	initbuffer(&strings);
+	initarena(&arena);
+
+	for (;;) {
+		readline(&in, &line);
+		if (line == NULL) {
+			break;
+		}
+		if (line[0] == '\0') {
+			continue;
+		}
+		lt = newlinetoken(&arena);
+		lt->line = line;
+		lexline(lt, strlen(line));
+		initheredoc(&heredoc);
+		if (lt->cmd->heredoc) {
+			readheredoc(&in, &heredoc);
+		}
+		compilecommand(&records, &tokens, &strings, lt, &heredoc);
+		freelinetoken(lt);
 	}
-	token[len - 2] = '\0';
+
+	header.nrecords = records.len / sizeof(ImageRecord);
+	header.ntokens = tokens.len / sizeof(ImageToken);
+	header.stringsize = strings.len;
+	result = writeimage(script, &header, &records, &tokens, &strings);
+
+	free(records.data);
+	free(tokens.data);
+	free(strings.data);
+	freearena(&arena);
+	freeinput(&in);
+	close(fd);
+	return result;
 }
 
-char *
-buildlocalpath(char *command)
+int
+validimage(Image *img, Input *in)
 {
-	char cwd[PATH_MAX];
-	char *commandpath;
-
-	if (getcwd(cwd, sizeof(cwd)) != NULL) {
-		commandpath = malloc(strlen(cwd) + strlen(command) + 2);
-		if (commandpath == NULL) {
-			perror("malloc");
-			return NULL;
-		}
-		sprintf(commandpath, "%s/%s", cwd, command);
-		return commandpath;
-	} else {
-		perror("getcwd");
-		return NULL;
+	ImageHeader *header = img->header;
+	struct stat st;
+	size_t size;
+
+	if (img->size < sizeof(ImageHeader) ||
+	    memcmp(header->magic, "SHELLIMG", sizeof(header->magic)) != 0 ||
+	    header->version != IMAGE_VERSION) {
+		return 0;
 	}
+	size = sizeof(ImageHeader) + header->nrecords * sizeof(ImageRecord) +
+	    header->ntokens * sizeof(ImageToken) + header->stringsize;
+	if (size != img->size || fstat(in->fd, &st) == -1) {
+		return 0;
+	}
+	return header->scriptsize == st.st_size &&
+	    header->mtimesec == st.st_mtim.tv_sec &&
+	    header->mtimensec == st.st_mtim.tv_nsec &&
+	    header->hash == hashinput(in);
 }
 
-char *
-findcommandinpath(char *command)
+/*
+ * Use <script>.shc when it was compiled from exactly this script (same
+ * size, mtime and contents hash); otherwise the script is run as usual.
+ */
+int
+loadimage(Image *img, char *script, Input *in)
 {
-	char *path;
-	char *path_copy;
-	char *full_path;
-	char *dir;
+	char *path = imagepath(script);
+	struct stat st;
+	int fd;
 
-	path = getenv("PATH");
-	if (path == NULL) {
-		return NULL;
+	img->base = NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1) {
+		return -1;
 	}
-
-	path_copy = strdup(path);
-	if (path_copy == NULL) {
-		perror("strdup");
-		return NULL;
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(ImageHeader)) {
+		close(fd);
+		return -1;
 	}
 
-	full_path = malloc(MAX_LINE);
-	if (full_path == NULL) {
-		perror("malloc");
-		free(path_copy);
-		return NULL;
+	img->size = st.st_size;
+	img->base = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			 fd, 0);
+	close(fd);
+	if (img->base == MAP_FAILED) {
+		img->base = NULL;
+		return -1;
 	}
 
-	dir = strtok(path_copy, ":");
-	while (dir != NULL) {
-		snprintf(full_path, MAX_LINE, "%s/%s", dir, command);
-		if (access(full_path, X_OK) == 0) {
-			free(path_copy);
-			return full_path;
-		}
-		dir = strtok(NULL, ":");
+	img->header = (ImageHeader *)img->base;
+	if (!validimage(img, in)) {
+		munmap(img->base, img->size);
+		img->base = NULL;
+		return -1;
 	}
+	img->records = (ImageRecord *)(img->header + 1);
+	img->tokens = (ImageToken *)(img->records + img->header->nrecords);
+	img->strings = (char *)(img->tokens + img->header->ntokens);
+	img->next = 0;
+	return 0;
+}
 
-	free(path_copy);
-	free(full_path);
-	fprintf(stderr, "Command not found in PATH: %s\n", command);
-	return NULL;
+void
+freeimage(Image *img)
+{
+	if (img->base != NULL) {
+		munmap(img->base, img->size);
+		img->base = NULL;
+	}
 }
 
-char *
-buildcommandpath(char *command)
+int
+imagecommand(Image *img, LineToken *lt, HereDoc *heredoc)
 {
-	if (islocalcommand(command)) {
-		if (dotandslash(command)) {
-			removedotslash(command);
-		}
-		return buildlocalpath(command);
-	} else {
-		return findcommandinpath(command);
+	ImageRecord *rec;
+	ImageToken *tok;
+	Command *cmd;
+	int i;
+
+	if (img->next == img->header->nrecords) {
+		return 0;
+	}
+	rec = &img->records[img->next++];
+
+	cmd = newcommand(lt->arena, rec->ntokens > 0 ? rec->ntokens : 1);
+	cmd->ntokens = rec->ntokens;
+	cmd->nwords = rec->nwords;
+	cmd->condition = rec->condition;
+	cmd->builtin = rec->builtin;
+	cmd->background = rec->background;
+	cmd->npipes = rec->npipes;
+	cmd->heredoc = rec->hasheredoc;
+	tok = &img->tokens[rec->tokens];
+	for (i = 0; i < rec->ntokens; i++) {
+		cmd->tokens[i].text = img->strings + tok[i].text;
+		cmd->tokens[i].kind = tok[i].kind;
+		cmd->tokens[i].flags = tok[i].flags;
+	}
+	if (rec->hasheredoc) {
+		heredoc->lines = img->strings + rec->heredoc;
+		heredoc->size = rec->heredocsize;
 	}
+	lt->cmd = cmd;
+	return 1;
 }
 
-void
-executecommand(char *commandpath, LineToken *lt, Redirection *redir,
-	       HereDoc *heredoc)
+/*
+ * Fetch the next command, either from the compiled image or by reading
+ * and parsing a line. Returns 0 at the end of the input.
+ */
+int
+readcommand(Input *in, Image *img, CommandCache *cache, LineToken *lt,
+	    HereDoc *heredoc)
 {
-	if (commandpath == NULL) {
-		freeall(lt, redir, heredoc);
-		exit(EXIT_FAILURE);
+	if (img->base != NULL) {
+		return imagecommand(img, lt, heredoc);
 	}
 
-	execv(commandpath, lt->tokens);
+	do {
+		readline(in, &lt->line);
+		if (lt->line == NULL) {
+			return 0;
+		}
+	} while (lt->line[0] == '\0');
 
-	perror("execv");
-	free(commandpath);
-	freeall(lt, redir, heredoc);
-	exit(EXIT_FAILURE);
+	parseline(cache, lt);
+	if (lt->cmd->heredoc) {
+		readheredoc(in, heredoc);
+	}
+	return 1;
 }
 
 void
-handleprocces(LineToken *lt, int background)
+usage(void)
 {
-	Redirection *redir;
-	HereDoc *heredoc;
-	char *commandpath;
-
-	initredirandheredoc(&redir, &heredoc, lt);
-	handleredirections(lt, redir, heredoc, background);
-	commandpath = buildcommandpath(lt->tokens[0]);
-	executecommand(commandpath, lt, redir, heredoc);
+	fprintf(stderr, "usage: shell [--compile] [--pathindex] [--shmindex] "
+		"[--spawn=fork|vfork|posix_spawn|zygote] [--pipefail] "
+		"[script]\n");
+	exit(EXIT_FAILURE);
 }
 
 void
-startprocess(LineToken *lt)
+parseoptions(int argc, char *argv[], Options *opts)
 {
-	int pidchild;
-	int background;
-
-	background = procbackground(lt->tokens);
-
-	if (background) {
-		erasetoken(lt->tokens, "&");
-	}
+	int i;
 
-	switch (pidchild = fork()) {
-	case -1:
-		perror("fork");
-		exit(EXIT_FAILURE);
-		break;
-	case 0:
-		handleprocces(lt, background);
-		freelinetoken(lt);
-		free(lt);
-		exit(EXIT_FAILURE);
-		break;
+	opts->compile = 0;
+	opts->pathindex = 0;
+	opts->shmindex = 0;
+	opts->spawn = SPAWN_FORK;
+	opts->pipefail = 0;
+	opts->script = NULL;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--compile") == 0) {
+			opts->compile = 1;
+		} else if (strcmp(argv[i], "--pathindex") == 0) {
+			opts->pathindex = 1;
+		} else if (strcmp(argv[i], "--shmindex") == 0) {
+			opts->shmindex = 1;
+		} else if (strcmp(argv[i], "--pipefail") == 0) {
+			opts->pipefail = 1;
+		} else if (strcmp(argv[i], "--spawn=fork") == 0) {
+			opts->spawn = SPAWN_FORK;
+		} else if (strcmp(argv[i], "--spawn=vfork") == 0) {
+			opts->spawn = SPAWN_VFORK;
+		} else if (strcmp(argv[i], "--spawn=posix_spawn") == 0) {
+			opts->spawn = SPAWN_POSIX;
+		} else if (strcmp(argv[i], "--spawn=zygote") == 0) {
+			opts->spawn = SPAWN_ZYGOTE;
+		} else if (argv[i][0] == '-' || opts->script != NULL) {
+			usage();
+		} else {
+			opts->script = argv[i];
+		}
 	}
-
-	if (background) {
-		printf("[%d]+ Start\n", pidchild);
-
-	} else {
-		waitchild(pidchild);
+	if (opts->compile && opts->script == NULL) {
+		usage();
 	}
 }
 
 int
 main(int argc, char *argv[])
 {
-	LineToken *lt = malloc(sizeof(LineToken));
-	int isterminal;
+	LineToken *lt;
+	Redirection *redir;
+	HereDoc *heredoc;
+	CommandCache cache;
+	PathTable table;
+	Spawner spawner;
+	Events events;
+	JobTable jobs;
+	Options opts;
+	Image image;
+	Arena arena;
+	Input input;
 	int skip = 0;
+	int fd;
 
 	signal(SIGINT, siginthandler);
 
-	if (lt == NULL) {
-		perror("malloc");
+	parseoptions(argc, argv, &opts);
+	initshell();
+
+	if (opts.compile) {
+		if (compilescript(opts.script) == -1) {
+			exit(EXIT_FAILURE);
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	spawner.engine = opts.spawn;
+	spawner.pipefail = opts.pipefail;
+	if (spawner.engine == SPAWN_ZYGOTE &&
+	    startzygote(&spawner.zygote) == -1) {
+		spawner.engine = SPAWN_FORK;
+	}
+	initjobtable(&jobs, opts.pipefail);
+	if (initevents(&events, spawner.engine == SPAWN_ZYGOTE ?
+		       &spawner.zygote : NULL, &jobs) == -1) {
 		exit(EXIT_FAILURE);
 	}
+	spawner.events = &events;
 
-	isterminal = itisterminal();
+	image.base = NULL;
+	if (opts.script != NULL) {
+		fd = open(opts.script, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			perror(opts.script);
+			exit(EXIT_FAILURE);
+		}
+		openinput(&input, fd, 0);
+		loadimage(&image, opts.script, &input);
+	} else {
+		openinput(&input, STDIN_FILENO, itisterminal());
+	}
+	if (!input.iswhole && watchinput(&events, input.fd) == 0) {
+		input.events = &events;
+	}
 
-	initshell();
+	initarena(&arena);
 
-	initlinetoken(lt);
+	initcache(&cache);
+	initpathtable(&table);
+	table.index = opts.pathindex;
+	table.shared = opts.shmindex;
+	table.events = &events;
 
 	do {
-		checkbackgroundchilds();
+		dispatchevents(&events, 0);
 
-		readline(&lt->line, isterminal);
+		lt = newlinetoken(&arena);
+		heredoc = arenaalloc(lt->arena, sizeof(HereDoc));
+		initheredoc(heredoc);
 
-		if (lt->line == NULL) {
+		if (readcommand(&input, &image, &cache, lt, heredoc) == 0) {
 			break;
 		}
 
-		if (lt->line[0] == '\n') {
-			freelinetoken(lt);
-			continue;
-		}
-
-		lt->tokens = tokenize(lt->line);
-		if (lt->tokens == NULL) {
-			freelinetoken(lt);
-			exit(EXIT_FAILURE);
-		}
-
-		removequotes(lt->tokens);
-
-		skip = replaceenvvars(lt->tokens);
+		initredirection(lt->arena, &redir);
+		skip = expandcommand(lt, redir);
 
 		if (skip) {
 			changeresult(1);
@@ -1038,13 +5818,6 @@ main(int argc, char *argv[])
 			continue;
 		}
 
-		if (nolinetoken(lt)) {
-			freelinetoken(lt);
-			continue;
-		}
-
-		globbing(&lt->tokens);
-
 		skip = manageifokifnot(lt);
 
 		if (skip) {
@@ -1057,20 +5830,30 @@ main(int argc, char *argv[])
 			continue;
 		}
 
-		if (exitcommand(lt->tokens)) {
+		if (exitcommand(lt->cmd)) {
 			break;
 		}
 
-		if (isenvassignment(lt->tokens)) {
-			handleenvassignment(lt->tokens);
+		if (isenvassignment(lt->cmd)) {
+			handleenvassignment(&table, lt->arena, &lt->stages[0]);
 			freelinetoken(lt);
 			continue;
 		}
 
-		if (builtincd(lt->tokens)) {
+		if (builtincd(lt->cmd)) {
 			changecwd(lt->tokens);
+		} else if (isparsecache(lt->cmd)) {
+			printcachestats(&cache);
+		} else if (ishash(lt->cmd)) {
+			hashcommand(&table, lt->tokens);
+		} else if (isjobs(lt->cmd)) {
+			jobscommand(&jobs, lt->tokens);
+		} else if (iswait(lt->cmd)) {
+			waitcommand(&events, lt->tokens);
+		} else if (iskill(lt->cmd)) {
+			killcommand(&jobs, lt->tokens);
 		} else {
-			startprocess(lt);
+			startprocess(&spawner, &table, lt, heredoc);
 		}
 
 		freelinetoken(lt);
@@ -1078,7 +5861,20 @@ main(int argc, char *argv[])
 	} while (1);
 
 	freelinetoken(lt);
-	free(lt);
+	freecache(&cache);
+	clearpathtable(&table);
+	unwatchpath(&table);
+	free(table.buckets);
+	if (spawner.engine == SPAWN_ZYGOTE) {
+		stopzygote(&spawner.zygote);
+	}
+	freeevents(&events);
+	freejobtable(&jobs);
+	freevars();
+	freedircache();
+	freeimage(&image);
+	freearena(&arena);
+	freeinput(&input);
 
 	exit(EXIT_SUCCESS);
 }